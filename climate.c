@@ -8,35 +8,49 @@
  * Output:   Summary information about the data.
  *
  * Compile:  run make
+ *           make climate-counters for a build that prints hot path counters on stderr at exit
+ *           make scale-bench to benchmark climate-fast on generated inputs, see scale_bench.sh
  *
  * Example Run:      ./climate data_tn.tdv data_wa.tdv
+ *                   zstd -dc data.tdv.zst | ./climate -
  *
  *
  * Opening file: data_tn.tdv
  * Opening file: data_wa.tdv
- * States found: TN WA
+ * States found:
+ * TN WA
  * -- State: TN --
  * Number of Records: 17097
  * Average Humidity: 49.4%
+ * Humidity Standard Deviation: 30.4%
  * Average Temperature: 58.3F
+ * Temperature Standard Deviation: 20.3F
+ * Median Temperature: 59.3F
+ * 95th Percentile Temperature: 93.2F
  * Max Temperature: 110.4F
- * Max Temperatuer on: Mon Aug  3 11:00:00 2015
+ * Max Temperature on: Mon Aug  3 18:00:00 2015
  * Min Temperature: -11.1F
- * Min Temperature on: Fri Feb 20 04:00:00 2015
+ * Min Temperature on: Fri Feb 20 12:00:00 2015
  * Lightning Strikes: 781
  * Records with Snow Cover: 107
  * Average Cloud Cover: 53.0%
+ * Cloud Cover Standard Deviation: 46.4%
  * -- State: WA --
  * Number of Records: 48357
  * Average Humidity: 61.3%
+ * Humidity Standard Deviation: 31.2%
  * Average Temperature: 52.9F
+ * Temperature Standard Deviation: 18.3F
+ * Median Temperature: 51.4F
+ * 95th Percentile Temperature: 88.8F
  * Max Temperature: 125.7F
- * Max Temperature on: Sun Jun 28 17:00:00 2015
+ * Max Temperature on: Mon Jun 29 00:00:00 2015
  * Min Temperature: -18.7F
- * Min Temperature on: Wed Dec 30 04:00:00 2015
+ * Min Temperature on: Wed Dec 30 12:00:00 2015
  * Lightning Strikes: 1190
  * Records with Snow Cover: 1383
  * Average Cloud Cover: 54.5%
+ * Cloud Cover Standard Deviation: 46.1%
  *
  * TDV format:
  *
@@ -63,13 +77,153 @@
  *      surface temperature (Kelvin)
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+//Vector instructions used to find delimiters 64 bytes at a time, see scan_block
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+//State codes are always two uppercase letters, so there are at most 26 * 26 of them. This covers DC, PR and
+//the territories as well as the 50 states.
+#define NUM_STATES (26 * 26)
+#define NUMBER_SZ 64 //Longest numeric field handed to the libc parsers, anything longer is malformed
+#define READ_BUF_SZ (1 << 20) //Size of each read() on streamed input
+#define PREFETCH_SLOTS 3 //Read buffers of a stream, one is parsed while the reader thread fills the others
+//Metrics of the report that can be picked with --metrics
+#define METRIC_HUMIDITY 1u
+#define METRIC_TEMP 2u
+#define METRIC_CLOUD 4u
+#define METRIC_SNOW 8u
+#define METRIC_LIGHTNING 16u
+#define METRIC_ALL 31u
+//Features of a run that need fields of their own besides the metrics, see RECORD_FIELDS
+#define NEED_BUCKET 32u //--bucket, the timestamp
+#define NEED_CELL 64u //--geohash, the geohash
+#define NEED_RECORD 128u //Every run, the state code that records are summarized by
+/* The TDV schema, one X(name, kind, member, need, arg) per field in file order. kind is how the field is decoded
+ * into rec->member, see the DECODE_ and CLEAR_ macros, and need is the METRIC_ and NEED_ bits of the runs that use
+ * it. Everything else is generated from this list: the field_index enum, the fields projection_skip leaves out and
+ * the decoders. A field no run needs costs nothing but being split. arg is passed through to X. */
+#define RECORD_FIELDS(X, arg) \
+    X(STATE, KEY, key, NEED_RECORD, arg) \
+    X(TIMESTAMP, LONG, timestamp, METRIC_TEMP | NEED_BUCKET, arg) \
+    X(GEOHASH, CELL, cell, NEED_CELL, arg) \
+    X(HUMIDITY, DECIMAL, humidity, METRIC_HUMIDITY, arg) \
+    X(SNOW, FLAG, snow, METRIC_SNOW, arg) \
+    X(CLOUD, DECIMAL, cloudCover, METRIC_CLOUD, arg) \
+    X(LIGHTNING, FLAG, lightning, METRIC_LIGHTNING, arg) \
+    X(PRESSURE, NONE, none, 0u, arg) \
+    X(TEMP, DECIMAL, kelvin, METRIC_TEMP, arg)
+#define FIELD_ENUM(name, kind, member, need, arg) FIELD_##name,
+//Position of each field in a record
+enum field_index {
+    RECORD_FIELDS(FIELD_ENUM, 0)
+    NUM_FIELDS
+};
+#undef FIELD_ENUM
+#define SKIP_BIT(name, kind, member, need, features) | ((need) & ((features) | NEED_RECORD) ? 0u : 1u << FIELD_##name)
+//Bit per field_index that a run with the METRIC_ and NEED_ bits in features doesn't use
+#define FIELD_SKIP(features) (0u RECORD_FIELDS(SKIP_BIT, features))
+//Records decoded before they are aggregated together, see struct record_batch
+#define BATCH_SZ 4096
+#define MAX_THREADS 64
+//Outcome of analyzing one file, see analyze_path
+#define FILE_PENDING (-1)
+#define FILE_OK 0
+#define FILE_MISSING 1
+#define FILE_FAILED 2
+//Size of the byte ranges -P splits mapped files into, each one ends at the next newline after this many bytes
+#define TASK_SZ ((size_t) 4 << 20)
+#define BENCH_ITERATIONS 5
+
+//Binary columnar cache format, see struct column_header
+#define COLUMN_MAGIC "CLIMCOL1"
+#define COLUMN_VERSION 1
+#define COLUMN_BYTE_ORDER 0x01020304u //Written natively, reads back differently on a machine of the other byte order
+#define COLUMN_BLOCK_RECORDS 65536 //Records per block
+#define MAX_COLUMN_STATES 256 //State IDs are one byte
+
+//Time bucket sizes for --bucket, buckets are counted from the epoch in UTC
+enum bucket_size {
+    BUCKET_NONE,
+    BUCKET_HOUR,
+    BUCKET_DAY,
+    BUCKET_MONTH
+};
+
+//Longest geohash prefix --geohash groups by, 12 characters of 5 bits fit in a 64 bit key with the length
+#define MAX_GEOHASH 12
+//Widest span of time buckets one state can have, about 120 years of hours. Records further out are left out
+#define MAX_BUCKETS (1L << 20)
+//Starting size of the geohash cell hash table, a power of two
+#define CELL_TABLE_MIN 1024
+//Size of the blocks an arena takes from malloc, larger requests get a block of their own
+#define ARENA_BLOCK ((size_t) 1 << 20)
+//Alignment of every arena allocation, enough for any of the accumulator structs
+#define ARENA_ALIGN ((size_t) 16)
 
-#define NUM_STATES 50
+//Temperature histogram every state keeps for its quantiles, TEMP_SKETCH_STEP bins per degree Fahrenheit from
+//TEMP_SKETCH_LOW to TEMP_SKETCH_HIGH, plus one bin for everything below that and one for everything above it
+#define TEMP_SKETCH_LOW (-130)
+#define TEMP_SKETCH_HIGH 150
+#define TEMP_SKETCH_STEP 10
+#define TEMP_SKETCH_BINS ((TEMP_SKETCH_HIGH - TEMP_SKETCH_LOW) * TEMP_SKETCH_STEP + 2)
+
+//Report formats of --format
+enum output_format {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON,
+    FORMAT_BINARY
+};
+//Binary summary format of --format=binary, see struct summary_header
+#define SUMMARY_MAGIC "CLIMSUM1"
+#define SUMMARY_VERSION 2
+//Room for one state in the csv and json formats, 20 numbers of at most 24 characters and their names
+#define SUMMARY_LINE_SZ 1024
+
+//Sidecar zone map index of a TDV file written by --index, see struct index_header
+#define INDEX_MAGIC "CLIMIDX1"
+#define INDEX_VERSION 1
+#define INDEX_SUFFIX ".idx"
+#define INDEX_BLOCK_SZ ((size_t) 64 << 10) //Each block ends at the next newline after this many bytes
+#define INDEX_STATE_WORDS ((NUM_STATES + 63) / 64)
+#define INDEX_UNPARSED 1u //Block flag, a line's state or timestamp doesn't parse so it's never skipped
+
+#define CHECKPOINT_MAGIC "climate-checkpoint"
+#define CHECKPOINT_VERSION 3
+
+/**
+ * Running total and sum of squared differences from the mean (Welford) of one metric. The total is a compensated
+ * (Neumaier) sum, which keeps the rounding error of every addition so it doesn't grow with the number of values or
+ * depend on the order summaries are merged in, and the mean is always total / count. The number of values is kept
+ * by the owner, and two stats merge with Chan's formula.
+ */
+struct running_stat {
+    double sum;
+    double comp; //Rounding error of sum, the total is sum + comp
+    double m2;
+};
 
 /**
  * Climate info is a struct that contains a summary of all the data entries analyzed per state
@@ -77,208 +231,3696 @@
 struct climate_info {
     char code[3]; //State Code
     unsigned long long num_records; ///Number of data entries per state summary
-    double totalTemp;
-    double totalHumidity;
+    struct running_stat temp; //Temperature in Fahrenheit
+    struct running_stat humidity;
     double maxTemp;
-    char maxTempDate[27];
+    time_t maxTempTS; //Time of the max temperature, only formatted when the report is printed
     double minTemp;
-    char minTempDate[27];
+    time_t minTempTS; //Time of the min temperature
     int lightningStrikeCount;
     int snowCoverCount;
-    double totalCloudCover;
+    struct running_stat cloudCover;
+};
+
+/**
+ * One tab separated field of a record. Nothing is promised about the byte after the field, the last record of a
+ * mapped file or of an --index range can end at the end of the mapping, so everything that reads a field goes by
+ * its len and never past it.
+ */
+struct field {
+    const char *ptr; //First byte of the field
+    size_t len; //Length of the field in bytes
+};
+
+/**
+ * A record after its fields have been decoded
+ */
+struct record {
+    int key; //State key from state_key
+    long timestamp; //Time of observation in milliseconds, as it appears in the file
+    double humidity;
+    double cloudCover;
+    double kelvin; //Surface temperature in Kelvin
+    int snow; //1 if there was snow cover
+    int lightning; //1 if there was a lightning strike
+    uint64_t cell; //Packed geohash prefix from geohash_key with --geohash, 0 otherwise or if it isn't valid
+};
+
+/**
+ * Decodes a split record, see decode_fields. select_decoder picks one made for the fields a run skips.
+ */
+typedef int decoder_fn(const struct field fields[], int num_fields, unsigned skip, int geohash, struct record *rec);
+
+/**
+ * Records decoded by the parser and waiting to be aggregated. Parsing fills the batch and flush_batch hands the
+ * whole batch to the state table at once, so each loop stays small and predictable instead of one loop doing both.
+ */
+struct record_batch {
+    struct record recs[BATCH_SZ];
+    int count; //Number of records waiting in recs
+};
+
+/**
+ * Header at the start of a columnar cache file written by --convert. It is followed by num_blocks blocks, each
+ * a struct column_block followed by its columns:
+ *      timestamp    int64_t[n]  milliseconds
+ *      temperature  float[n]    Kelvin
+ *      state        uint8_t[n]  index into codes
+ *      humidity     uint8_t[n]  whole percent
+ *      cloud cover  uint8_t[n]  whole percent
+ *      snow         (n + 7) / 8 bytes, one bit per record
+ *      lightning    (n + 7) / 8 bytes, one bit per record
+ * and zero padding up to a multiple of 8 bytes so every block and column stays aligned inside a mapping.
+ * All values are in native byte order.
+ */
+struct column_header {
+    char magic[8]; //COLUMN_MAGIC, not terminated
+    uint32_t version; //COLUMN_VERSION
+    uint32_t byte_order; //COLUMN_BYTE_ORDER
+    uint32_t num_codes; //Number of entries used in codes
+    uint32_t reserved;
+    uint64_t num_records;
+    uint64_t num_blocks;
+    char codes[MAX_COLUMN_STATES][2]; //State code of each state ID
+};
+
+/**
+ * Header of a binary summary file written by --format=binary. It is followed by num_states summary_state entries,
+ * in the order the states were first seen. All values are in native byte order.
+ */
+struct summary_header {
+    char magic[8]; //SUMMARY_MAGIC, not terminated
+    uint32_t version; //SUMMARY_VERSION
+    uint32_t byte_order; //COLUMN_BYTE_ORDER
+    uint32_t num_states;
+    uint32_t reserved;
+    uint64_t malformed; //Lines skipped because they didn't parse as a record
+};
+
+/**
+ * Summary of one state in a binary summary file. The running stats are stored raw, so summaries of separate runs
+ * can be merged exactly.
+ */
+struct summary_state {
+    char code[2];
+    char reserved[6];
+    uint64_t num_records;
+    double temp[3]; //sum, comp and m2 of the running_stat
+    double humidity[3];
+    double cloudCover[3];
+    double maxTemp;
+    double minTemp;
+    int64_t maxTempTS;
+    int64_t minTempTS;
+    uint64_t lightningStrikeCount;
+    uint64_t snowCoverCount;
+    uint64_t tempBins[TEMP_SKETCH_BINS]; //Temperature histogram, see TEMP_SKETCH_BINS
+};
+
+/**
+ * Header of the sidecar index of a TDV file, path + INDEX_SUFFIX. It is followed by num_blocks index_block
+ * entries that cover the file in order. The index is rebuilt when the size or modification time of the file
+ * no longer match. All values are in native byte order.
+ */
+struct index_header {
+    char magic[8]; //INDEX_MAGIC, not terminated
+    uint32_t version; //INDEX_VERSION
+    uint32_t byte_order; //COLUMN_BYTE_ORDER
+    uint64_t file_size; //Size of the TDV file the index was built from
+    int64_t mtime_sec; //Modification time of the TDV file the index was built from
+    int64_t mtime_nsec;
+    uint64_t num_blocks;
+};
+
+/**
+ * Zone map of one block of a TDV file, a run of whole lines of about INDEX_BLOCK_SZ bytes
+ */
+struct index_block {
+    uint64_t offset; //Byte offset of the block, always the start of a line
+    uint64_t len;
+    int64_t min_timestamp; //Range of the timestamps in this block, in milliseconds. min > max when it has no records
+    int64_t max_timestamp;
+    uint32_t flags; //INDEX_UNPARSED
+    uint32_t reserved;
+    uint64_t states_present[INDEX_STATE_WORDS]; //Bit set for every state key that appears in this block
+};
+
+/**
+ * A range of bytes of a file
+ */
+struct byte_range {
+    size_t start;
+    size_t len;
+};
+
+/**
+ * Header of one block of a columnar cache file
+ */
+struct column_block {
+    uint32_t num_records;
+    uint32_t size; //Size of the block in bytes including this header, columns and padding
+    int64_t min_timestamp; //Range of the timestamps in this block, in milliseconds
+    int64_t max_timestamp;
+    uint64_t states_present[MAX_COLUMN_STATES / 64]; //Bit set for every state ID that appears in this block
+};
+
+struct column_writer;
+
+/**
+ * How much of one input file the saved summaries already cover
+ */
+struct checkpoint_file {
+    unsigned long long dev; //Device and inode identify the file however its path is spelled
+    unsigned long long ino;
+    unsigned long long offset; //Bytes already summarized, always just past a newline
+    char *path; //Path the file was last opened with, kept so the checkpoint is readable
+    char *tail; //Record at the end of the file that has no newline yet, summarized after the checkpoint is saved
+    size_t tail_len;
+};
+
+/**
+ * Files covered by a checkpoint, see load_checkpoint for the file format
+ */
+struct checkpoint {
+    struct checkpoint_file *files;
+    int num_files;
+    int capacity;
+};
+
+/**
+ * Block of an arena, its memory follows the header
+ */
+struct arena_block {
+    struct arena_block *prev; //Block allocated before this one
+};
+
+/**
+ * Bump allocator for the accumulators of a state table (time buckets, geohash cells and the cell hash table).
+ * Memory is handed out from ARENA_BLOCK sized blocks, so creating accumulators never calls malloc per accumulator,
+ * and it is given back all at once by arena_free. Arrays that grow are copied into a new allocation and the old
+ * one is left in the arena; since they double, that at most doubles what they use.
+ */
+struct arena {
+    struct arena_block *blocks; //Newest block, NULL while the arena is empty
+    char *next; //Next free byte of the newest block
+    char *end; //End of the newest block
 };
 
 /**
- * @param file - Data file that the method will be analyzing
- * @param states - Array containing climate info structs for all 50 states
- * @param num_states - the number of states in the US- 50
+ * Summary of one geohash cell, kept in the dense cells array of a cell_table.
  */
-void analyze_file(FILE *file, struct climate_info *states[], int num_states);
+struct geo_cell {
+    uint64_t key; //Packed geohash prefix from geohash_key
+    struct climate_info info; //Summary of the cell, without a code or buckets
+};
 
-void print_report(struct climate_info *states[], int num_states);
+/**
+ * Summaries of the geohash cells seen with --geohash. The cells themselves live densely in insertion order, and an
+ * open addressing hash table with linear probing maps each packed key to its position there. The table slots are
+ * kept small so a probe sequence stays within a cache line or two even with hundreds of thousands of cells.
+ */
+struct cell_table {
+    uint64_t *keys; //Packed key of each hash slot, 0 for an empty slot
+    uint32_t *index; //Position in cells of the key in the same slot
+    size_t capacity; //Number of hash slots, a power of two
+    struct geo_cell *cells; //Cell summaries in insertion order
+    size_t num_cells; //Number of entries used in cells
+    size_t cells_capacity; //Number of entries allocated in cells
+};
 
 /**
+ * Per state totals laid out as one array per metric, indexed by the position of the state in first-seen order.
+ * A record updates one element of each array, and the few states of a file keep every array down to a cache line
+ * or two, where one malloc'd climate_info per state scattered them across the heap.
  *
- * @param states- Array containing climate info structs for all 50 states
- * @param stateCode- State Code of the state we are looking for
- * @return Index of the state in the states array. If states doesn't contain the state code the method returns the
- * negative index of the next null struct in the states array
- */
-int indexOfState(struct climate_info **states, char *stateCode) {
-    int i; //index
-    //Look for the first null struct
-    for (i = 0; states[i] != NULL; i++) {
-        //If we find thtat the state is already initialized return its index
-        if (strcmp(states[i]->code, stateCode) == 0) return i;
-    }
-    //If the state is not found we return the index of the first null spot in the array and use the negative sign
-    //as a flag to initialize a new struct.
-    //Zero is a special case because it has no sign
-    if (i == 0) {
-        return -50;
-    } else return -i;
+ * Records only add their value, its difference from a shift (the mean before the batch) and that difference
+ * squared to plain batch sums, which costs no division. fold_stats merges the batch into the running stats once
+ * per batch, so outside of aggregate_batch the batch sums are always zero.
+ */
+struct state_columns {
+    unsigned long long num_records[NUM_STATES];
+    unsigned long long folded[NUM_STATES]; //Records already merged into the running stats
+    struct running_stat temp[NUM_STATES];
+    struct running_stat humidity[NUM_STATES];
+    struct running_stat cloudCover[NUM_STATES];
+    double tempTotal[NUM_STATES]; //Batch sums of the values, of (value - shift) and of (value - shift)^2
+    double tempShift[NUM_STATES];
+    double tempSum[NUM_STATES];
+    double tempSq[NUM_STATES];
+    double humidityTotal[NUM_STATES];
+    double humidityShift[NUM_STATES];
+    double humiditySum[NUM_STATES];
+    double humiditySq[NUM_STATES];
+    double cloudCoverTotal[NUM_STATES];
+    double cloudCoverShift[NUM_STATES];
+    double cloudCoverSum[NUM_STATES];
+    double cloudCoverSq[NUM_STATES];
+    double maxTemp[NUM_STATES];
+    double minTemp[NUM_STATES];
+    time_t maxTempTS[NUM_STATES]; //Time of the max temperature, only formatted when the report is printed
+    time_t minTempTS[NUM_STATES]; //Time of the min temperature
+    int lightningStrikeCount[NUM_STATES];
+    int snowCoverCount[NUM_STATES];
+    //Temperature histogram for the quantiles, TEMP_SKETCH_BINS counts from the arena, NULL if it couldn't be had
+    uint64_t *tempBins[NUM_STATES];
+};
+
+/**
+ * Time bucket summaries of one state with --bucket, a dense array of cells for buckets first to first + count - 1.
+ * Cells are climate_info structs without a code.
+ */
+struct bucket_array {
+    struct climate_info *cells; //NULL until the state gets its first bucket
+    long first; //Bucket number of cells[0]
+    int count; //Number of cells, empty ones included
+};
+
+/**
+ * Records to keep, set with --states, --from and --to. The parser checks the state and timestamp of a record
+ * before anything else and skips the rest of it when the filter rejects it, so rejected records are neither
+ * summarized nor checked for being malformed.
+ */
+struct record_filter {
+    int by_state; //Set when only the states marked in keep are wanted
+    unsigned char keep[NUM_STATES]; //State key -> 1 if the state is wanted
+    long from; //Unix time in seconds of the first record wanted, inclusive
+    long to; //Unix time in seconds the wanted records end at, exclusive
+};
+
+#ifdef CLIMATE_COUNTERS
+/**
+ * Instrumentation counters of one state table, summed over threads when tables are merged. Only compiled in with
+ * -DCLIMATE_COUNTERS, see print_counters.
+ */
+struct counters {
+    unsigned long long bytes_read; //Bytes handed to the text and columnar parsers
+    unsigned long long records; //Records decoded
+    unsigned long long filtered; //Records and columnar blocks rejected by --states, --from or --to
+    unsigned long long bytes_skipped; //Bytes of TDV files never read because their --index blocks didn't match
+    unsigned long long new_states; //States created while aggregating, once per table that saw them
+    unsigned long long max_updates; //Times a state's max temperature was raised
+    unsigned long long min_updates; //Times a state's min temperature was lowered
+    unsigned long long io_ns; //Time spent reading and mapping files
+    unsigned long long ingest_ns; //Time spent parsing, the aggregation included
+    unsigned long long aggregate_ns; //Time spent aggregating or converting batches
+};
+#define COUNTER_ADD(states, name, n) ((states)->counters.name += (unsigned long long) (n))
+#define COUNTER_START(var) const unsigned long long var = counter_now()
+#define COUNTER_STOP(states, name, var) COUNTER_ADD(states, name, counter_now() - (var))
+#else
+#define COUNTER_ADD(states, name, n) ((void) 0)
+#define COUNTER_START(var) ((void) 0)
+#define COUNTER_STOP(states, name, var) ((void) 0)
+#endif
+
+/**
+ * State table holds the summary of every state seen so far. States are numbered in the order they were first
+ * seen, which is the order they are reported in, and that number indexes codes, totals and buckets. The slot
+ * array is indexed directly by the state key (see state_key) and holds the number of that state plus one, zero
+ * meaning not seen yet.
+ */
+struct state_table {
+    char codes[NUM_STATES][3]; //State codes in first-seen order
+    struct state_columns totals; //Summary of every state
+    struct bucket_array buckets[NUM_STATES]; //Time buckets of every state with --bucket
+    unsigned short slot[NUM_STATES]; //State key -> state number + 1
+    int num_states; //Number of states seen
+    unsigned long long malformed; //Lines skipped because they didn't parse as a record
+    unsigned long long unbucketed; //Records left out of the time buckets of their state, see bucket_cell
+    unsigned long long ungrouped; //Records left out of the geohash cells, mostly for a geohash that isn't valid
+    struct column_writer *convert; //When set, parsed records are written here by --convert instead of summarized
+    enum bucket_size bucket; //Size of the time buckets each state is also summarized by
+    int geohash; //Length of the geohash prefix records are also grouped by, 0 when not grouping
+    unsigned skip_fields; //Bit per field_index that decode_fields doesn't convert, for metrics that aren't reported
+    decoder_fn *decode; //Decoder for skip_fields from select_decoder
+    unsigned hidden_metrics; //METRIC_* bits left out of the report
+    const struct record_filter *filter; //Records to keep, NULL for all of them. Shared read only between threads
+    int indexed; //Set by --index, mapped TDV files are read through their sidecar index, see index_ranges
+    struct cell_table cells; //Summaries per geohash cell when geohash is set
+    struct arena arena; //Memory of the bucket arrays and cell table, freed by free_states
+    int timed; //Set by --bench to time the aggregation stage
+    double aggregate_time; //Seconds spent aggregating batches while timed, summed over threads
+#ifdef CLIMATE_COUNTERS
+    struct counters counters;
+#endif
+};
+
+/**
+ * One read buffer of a prefetcher. The complete records of a read are buf[start] to buf[end - 1], anything after
+ * them is copied to the front of the next slot before it is filled.
+ */
+struct prefetch_slot {
+    char *buf; //READ_BUF_SZ bytes
+    size_t start;
+    size_t end;
+    unsigned long long dropped; //Records longer than a buffer skipped since the previous slot, counted as malformed
+    int full; //Set from the time the reader is done with the slot until it has been parsed
+};
+
+/**
+ * Ring of read buffers a reader thread fills ahead of the parser, so reading the next part of a stream overlaps
+ * parsing the current one. The reader fills slots in ring order and the parser empties them in the same order.
+ */
+struct prefetcher {
+    int fd;
+    struct state_table *states; //Only used by the reader when it isn't threaded
+    int threaded; //Cleared if the reader thread couldn't be started, then it parses every slot as soon as it's full
+    struct prefetch_slot slots[PREFETCH_SLOTS];
+    pthread_mutex_t lock; //Guards full of every slot and done
+    pthread_cond_t changed; //Signalled whenever a slot is filled or emptied, and when the reader is done
+    int done; //Set once the reader won't fill any more slots
+    int status; //0, or -1 if a read failed or the stream is a columnar file
+#ifdef CLIMATE_COUNTERS
+    struct counters counters; //Time the reader spends in read(), added to the table once it is done
+#endif
+};
+
+/**
+ * Streams a descriptor that can't be mapped, such as stdin or a pipe, through PREFETCH_SLOTS READ_BUF_SZ buffers.
+ * A reader thread cuts each read after its last complete record and carries the partial record at the end over
+ * to the front of the next buffer, while the calling thread hands the complete records to analyze_buffer.
+ * @param fd - Descriptor the method will be analyzing
+ * @param states - Table containing climate info structs for every state seen so far
+ * @return 0 on success, -1 if the buffer couldn't be allocated or a read failed
+ */
+int analyze_file(int fd, struct state_table *states);
+
+/**
+ * Zero-copy counterpart of analyze_file used for memory mapped input. Records of any length are parsed in place
+ * with pointer arithmetic and nothing is read past buf + len, so the last record doesn't need a newline.
+ * @param buf - Start of the mapped file contents
+ * @param len - Number of bytes in buf
+ * @param states - Table containing climate info structs for every state seen so far
+ */
+void analyze_buffer(const char *buf, size_t len, struct state_table *states);
+
+/**
+ * Decodes an already split record. Records that don't have exactly NUM_FIELDS fields, a two letter state code and
+ * numeric timestamp, humidity, cloud cover and temperature are malformed. A geohash that is too short or isn't
+ * one leaves rec->cell 0, the record still counts for its state but not for any geohash cell. Skipped fields are
+ * neither converted nor checked, and are zero in rec. This checks skip at run
+ * time, the decoders from select_decoder do the same with the skipped fields compiled out.
+ * @param fields - The fields of the record, only the first NUM_FIELDS are looked at
+ * @param num_fields - Number of fields the record had
+ * @param skip - Bit per field_index to leave alone, see projection_skip
+ * @param geohash - Length of the geohash prefix to pack into rec->cell, unused when the geohash is skipped
+ * @param rec - Receives the record
+ * @return 1 if the record was decoded, 0 if it is malformed
+ */
+int decode_fields(const struct field fields[], int num_fields, unsigned skip, int geohash, struct record *rec);
+
+/**
+ * @param skip - Bit per field_index a run leaves alone, from projection_skip
+ * @return A decoder specialized for skip, or decode_fields when there isn't one
+ */
+decoder_fn *select_decoder(unsigned skip);
+
+/**
+ * Adds every record of a batch to the summaries of their states, or appends them to states->convert when
+ * converting, and empties the batch.
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param batch - Decoded records
+ */
+void flush_batch(struct state_table *states, struct record_batch *batch);
+
+/**
+ * Adds decoded records to the summaries of their states.
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param recs - The records
+ * @param count - Number of records
+ */
+void aggregate_batch(struct state_table *states, const struct record *recs, int count);
+
+/**
+ * Adds a decoded record to the summary of its state. The means and deviations only catch up once the batch is
+ * folded, which aggregate_batch does.
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param rec - The record
+ */
+void aggregate_record(struct state_table *states, const struct record *rec);
+
+/**
+ * Analyzes a memory mapped file, which is either TDV text or a columnar cache file.
+ * @param map - Start of the mapping
+ * @param len - Size of the mapping
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param num_threads - Number of worker threads to parse TDV text with
+ * @return 0 on success, -1 if the file is a columnar cache file that is damaged
+ */
+int analyze_mapping(const char *map, size_t len, struct state_table *states, int num_threads);
+
+/**
+ * Analyzes a columnar cache file written by --convert.
+ * @param buf - Start of the file contents
+ * @param len - Number of bytes in buf
+ * @param states - Table containing climate info structs for every state seen so far
+ * @return 0 on success, -1 if the file is truncated or damaged
+ */
+int analyze_columnar(const char *buf, size_t len, struct state_table *states);
+
+/**
+ * Creates a columnar cache file for --convert.
+ * @param path - Path of the file to create, an existing file is replaced
+ * @return The writer, or NULL if the file couldn't be created
+ */
+struct column_writer *column_writer_open(const char *path);
+
+/**
+ * Adds a record to the block being built, writing the block out once it is full.
+ * @param writer - Writer from column_writer_open
+ * @param rec - The record
+ */
+void column_writer_append(struct column_writer *writer, const struct record *rec);
+
+/**
+ * Writes the last block and the final header, then closes the file and frees the writer.
+ * @param writer - Writer from column_writer_open
+ * @param num_records - Receives the number of records written
+ * @return 0 on success, -1 if anything failed to write or there were more than MAX_COLUMN_STATES states
+ */
+int column_writer_close(struct column_writer *writer, unsigned long long *num_records);
+
+/**
+ * Memory maps a regular, non-empty file for reading.
+ * @param fd - Open descriptor of the file
+ * @param len - Receives the size of the mapping
+ * @return Start of the mapping, or NULL if the file isn't a regular file or can't be mapped
+ */
+const char *map_file(int fd, size_t *len);
+
+/**
+ * Memory maps a regular file and analyzes it with analyze_buffer, or analyze_parallel when more than one
+ * thread is requested. With --index only the parts of a TDV file that its index allows are analyzed.
+ * @param fd - Open descriptor of the file
+ * @param path - Path of the file, NULL if it has none and so no index
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param num_threads - Number of worker threads to parse the file with
+ * @return 1 if the file was mapped and analyzed, 0 if the caller should fall back to analyze_file, -1 if it was
+ * mapped but is a damaged columnar cache file
+ */
+int analyze_mapped(int fd, const char *path, struct state_table *states, int num_threads);
+
+/**
+ * Splits a buffer into chunks at newline boundaries and parses each chunk on its own thread into a private
+ * states table. The private tables are merged into states in chunk order once every worker has finished.
+ * @param buf - Start of the mapped file contents
+ * @param len - Number of bytes in buf
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param num_threads - Number of chunks/worker threads
+ */
+void analyze_parallel(const char *buf, size_t len, struct state_table *states, int num_threads);
+
+/**
+ * Folds the summaries in partial into states. Counts and totals are summed, and the max/min temperatures keep
+ * the extreme along with its timestamp. Ties keep the timestamp already in states, so merging chunks in file order
+ * gives the same dates as a serial run. Partial is left empty, and the memory it
+ * used stays in its arena until free_states.
+ * @param states - Table the summaries are merged into
+ * @param partial - Table of summaries to merge, left empty afterwards
+ */
+void merge_states(struct state_table *states, struct state_table *partial);
+
+/**
+ * Opens and analyzes one input file, "-" being stdin. Regular files are mapped, anything else is streamed.
+ * @param path - Path of the file
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param num_threads - Number of worker threads to parse a mapped file with
+ * @param cp - Checkpoint to analyze only the appended part against, or NULL to analyze the whole file
+ * @return FILE_OK, FILE_MISSING if it couldn't be opened or FILE_FAILED if it couldn't be read
+ */
+int analyze_path(const char *path, struct state_table *states, int num_threads, struct checkpoint *cp);
+
+/**
+ * Analyzes files on a pool of worker threads. Mapped TDV files are cut into TASK_SZ byte ranges, so one huge file
+ * and many small ones spread over the workers alike. Each worker starts on its own contiguous share of the tasks
+ * and steals from the far end of another worker's share once its own runs out. Every task is summarized into its
+ * own table, and the main thread merges those in file order as they finish, printing the opening and error
+ * messages in argv order along the way, so the report is the same as a serial run.
+ * @param files - Paths of the files
+ * @param num_files - Number of files
+ * @param states - Table the summaries of every file are merged into
+ * @param num_workers - Number of worker threads
+ * @param progress - Stream the opening and error messages are printed to
+ */
+void analyze_files_parallel(char *files[], int num_files, struct state_table *states, int num_workers,
+                            FILE *progress);
+
+/**
+ * Loads the summaries and file offsets saved by a previous --checkpoint run. A checkpoint is a text file:
+ *      climate-checkpoint 3
+ *      malformed <count>
+ *      state <code> <records> <temp sum> <temp comp> <temp m2> <humidity sum> <humidity comp> <humidity m2>
+ *            <cloud sum> <cloud comp> <cloud m2> <maxTemp> <maxTempTS> <minTemp> <minTempTS> <lightning> <snow>
+ *                                                      (all on one line, one line per state in first-seen order)
+ *      sketch <code> <bin>:<count> ...                (temperature histogram of the state above, non empty bins)
+ *      file <dev> <inode> <offset> <path>             (one line per input file)
+ * Doubles are written with %a so they read back exactly.
+ * @param path - Path of the checkpoint, a missing file is an empty checkpoint
+ * @param states - Empty table the saved summaries are loaded into
+ * @param cp - Empty checkpoint the saved file offsets are loaded into
+ * @return 0 on success, -1 if the checkpoint can't be read or is damaged
+ */
+int load_checkpoint(const char *path, struct state_table *states, struct checkpoint *cp);
+
+/**
+ * Saves the summaries and file offsets for the next --checkpoint run. The checkpoint is written to a temporary file
+ * and renamed over the old one, so a failed run never leaves a half written checkpoint behind.
+ * @param path - Path of the checkpoint
+ * @param states - Summaries of everything up to the saved offsets
+ * @param cp - Offsets of every input file
+ * @return 0 on success, -1 if it couldn't be written
+ */
+int save_checkpoint(const char *path, struct state_table *states, struct checkpoint *cp);
+
+/**
+ * Analyzes only the part of a regular file that was appended since the checkpoint was saved, and moves the offset
+ * of the file in the checkpoint up to the last complete record. A record at the very end without a newline is kept
+ * in the checkpoint as a tail, to be summarized by finish_checkpoint after the checkpoint is saved.
+ * @param fd - Open descriptor of the file
+ * @param cp - Checkpoint being updated
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param num_threads - Number of worker threads to parse the file with
+ * @param path - Path the file was opened with
+ * @return 0 on success, -1 if the file can't be analyzed incrementally
+ */
+int analyze_appended(int fd, const char *path, struct checkpoint *cp, struct state_table *states, int num_threads);
+
+/**
+ * Summarizes the tails left by analyze_appended and frees the checkpoint.
+ * @param cp - Checkpoint to finish
+ * @param states - Table containing climate info structs for every state seen so far
+ */
+void finish_checkpoint(struct checkpoint *cp, struct state_table *states);
+
+/**
+ * Frees every summary in the table and leaves it empty.
+ * @param states - Table to clear
+ */
+void free_states(struct state_table *states);
+
+/**
+ * @param out - Stream the report is written to
+ * @param states - Table containing climate info structs for every state seen so far
+ */
+void print_report(FILE *out, struct state_table *states);
+
+/**
+ * Prints the per bucket summaries of every state collected with --bucket, one table per state.
+ * @param out - Stream the report is written to
+ * @param states - Table containing climate info structs for every state seen so far
+ */
+void print_buckets(FILE *out, struct state_table *states);
+
+/**
+ * Prints the summary of every geohash cell collected with --geohash, in geohash order.
+ * @param out - Stream the report is written to
+ * @param states - Table containing the cell summaries
+ */
+void print_cells(FILE *out, struct state_table *states);
+
+/**
+ * Writes the summary of every state in a machine readable format with a single write. Besides the means and
+ * standard deviations, the csv and json formats hold the totals and M2 of every metric, and the binary format the
+ * running stats exactly as they are kept, so results of separate runs can be merged without the input.
+ * @param fd - Descriptor the summaries are written to
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param format - FORMAT_CSV, FORMAT_JSON or FORMAT_BINARY
+ * @return 0 on success, -1 if out of memory or the write failed
+ */
+int write_summaries(int fd, struct state_table *states, enum output_format format);
+
+/**
+ * Reduces a binary summary file written by --format=binary into the table, as if its input had been analyzed
+ * here. The whole file is checked before anything is merged, so a damaged file leaves the table untouched.
+ * @param path - Path of the summary file, "-" being stdin
+ * @param states - Table the summaries are merged into
+ * @return FILE_OK, FILE_MISSING if it couldn't be opened or FILE_FAILED if it couldn't be read or is damaged
+ */
+int merge_summary_file(const char *path, struct state_table *states);
+
+static long bucket_of(time_t ts, enum bucket_size size);
+static struct climate_info *bucket_cell(struct bucket_array *buckets, struct arena *arena, long bucket);
+static void add_to_info(struct climate_info *ci, const struct record *rec, double temp, time_t currentTS);
+static struct climate_info *cell_find(struct cell_table *table, struct arena *arena, uint64_t key);
+static void *arena_alloc(struct arena *arena, size_t size);
+static void arena_free(struct arena *arena);
+static double bench_now(void);
+static unsigned projection_skip(unsigned metrics, enum bucket_size bucket, int geohash);
+static int parse_long(const char *field, size_t len, long *value);
+
+#ifdef CLIMATE_COUNTERS
+/**
+ * @return Nanoseconds on the monotonic clock
+ */
+static unsigned long long counter_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ull + (unsigned long long) ts.tv_nsec;
 }
 
-int main(int argc, char *argv[]) {
+/**
+ * Prints the instrumentation counters as one key=value pair per line, so scripts can pick them up from stderr.
+ * Parse time is the ingest time without the aggregation, all times are summed over threads except wall_ns.
+ * @param out - Stream the counters are written to
+ * @param states - Table the counters were collected in
+ * @param started - counter_now() when the run started
+ */
+static void print_counters(FILE *out, const struct state_table *states, unsigned long long started) {
+    const struct counters *c = &states->counters;
+    fprintf(out, "counters.bytes_read=%llu\n", c->bytes_read);
+    fprintf(out, "counters.records=%llu\n", c->records);
+    fprintf(out, "counters.filtered=%llu\n", c->filtered);
+    fprintf(out, "counters.bytes_skipped=%llu\n", c->bytes_skipped);
+    fprintf(out, "counters.malformed=%llu\n", states->malformed);
+    fprintf(out, "counters.new_states=%llu\n", c->new_states);
+    fprintf(out, "counters.max_updates=%llu\n", c->max_updates);
+    fprintf(out, "counters.min_updates=%llu\n", c->min_updates);
+    fprintf(out, "counters.io_ns=%llu\n", c->io_ns);
+    fprintf(out, "counters.parse_ns=%llu\n", c->ingest_ns > c->aggregate_ns ? c->ingest_ns - c->aggregate_ns : 0);
+    fprintf(out, "counters.aggregate_ns=%llu\n", c->aggregate_ns);
+    fprintf(out, "counters.wall_ns=%llu\n", counter_now() - started);
+}
+#endif
 
-    if (argc < 2) { //Check for at least one data file
-        printf("Usage: %s tdv_file1 tdv_file2 ... tdv_fileN \n", argv[0]);
-        return EXIT_FAILURE;
-    }
+/**
+ * Runs the whole ingest and report several times over the given files and prints how long each phase took,
+ * along with record and byte throughput. Reports are written to /dev/null so only the benchmark is printed.
+ * @param files - Paths of the files to analyze, they must be regular files
+ * @param num_files - Number of entries in files
+ * @param iterations - Number of times to repeat the run
+ * @param num_threads - Number of worker threads to parse each file with
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if a file couldn't be mapped
+ */
+int run_benchmark(char *files[], int num_files, int iterations, int num_threads);
 
-    /* Let's create an array to store our state data in. As we know, there are
-     * 50 US states. */
-    struct climate_info *states[NUM_STATES] = {NULL};
+/**
+ * @param stateCode - State Code to look up, not necessarily terminated
+ * @param len - Length of stateCode
+ * @return Key of the state code in [0, NUM_STATES), or -1 if it isn't two uppercase ASCII letters
+ */
+static int state_key(const char *stateCode, size_t len) {
+    if (len != 2) return -1;
+    const unsigned first = (unsigned char) stateCode[0] - 'A';
+    const unsigned second = (unsigned char) stateCode[1] - 'A';
+    //Unsigned wrap around turns anything below 'A' into a large value, so one compare checks both bounds
+    if (first >= 26 || second >= 26) return -1;
+    return (int) (first * 26 + second);
+}
 
-    FILE *file;
-    for (int i = 1; i < argc; i++) {
-        file = fopen(argv[i], "r"); //Open the file for reading
-        printf("Opening file: %s\n", argv[i]);
-
-        if (file != NULL) {
-            //If the file exists analyze it
-            analyze_file(file, states, NUM_STATES);
-            fclose(file);
-        } else {
-            //If not print an error
-            printf("Error File # %d doesn't exist!\n", i);
-        }
-    }
+/**
+ * Adds a value to the compensated total of a running stat.
+ */
+static void stat_sum(struct running_stat *s, double x) {
+    const double t = s->sum + x;
+    //Whichever operand is larger in magnitude, the error is what the smaller one lost
+    if ((s->sum < 0 ? -s->sum : s->sum) >= (x < 0 ? -x : x)) {
+        s->comp += (s->sum - t) + x;
+    } else s->comp += (x - t) + s->sum;
+    s->sum = t;
+}
 
-    /* Now that we have recorded data for each file, we'll summarize them: */
-    print_report(states, NUM_STATES);
+/**
+ * @param s - Running stat
+ * @param n - Number of values in s
+ * @return Mean of the values, 0 if there are none
+ */
+static double stat_mean(const struct running_stat *s, unsigned long long n) {
+    return n > 0 ? (s->sum + s->comp) / (double) n : 0;
+}
 
-    return 0;
+/**
+ * Adds one value to a running stat.
+ * @param s - The stat
+ * @param n - Number of values including this one
+ * @param x - The value
+ */
+static void stat_add(struct running_stat *s, unsigned long long n, double x) {
+    const double delta = x - stat_mean(s, n - 1);
+    s->m2 += delta * delta * ((double) (n - 1) / (double) n);
+    stat_sum(s, x);
 }
 
-void analyze_file(FILE *file, struct climate_info **states, int num_states) {
-    //Size of each line we are splitting
-    const int line_sz = 100;
-    //Line we are splitting
-    char line[line_sz];
-    //Using tab as the delimiter
-    char delim[2] = "\t";
-    //Current split will be stored in token, so we can handle the data
-    char *token;
-
-    //While there is a file to get -> get it
-    while (fgets(line, line_sz, file) != NULL) {
-        //First token is the state code
-        token = strtok(line, delim);
-        //Get the index of the state code or the index of the next free space in the states array
-        int index = indexOfState(states, token);
-        //Declare our struct to edit
-        struct climate_info *ci;
-        //if index is negative then it's a new state, so we must allocate memory
-        if (index < 0) {
-            //Allocate the memory
-            ci = (struct climate_info*)malloc(sizeof(struct climate_info));
-            //Set the code to state code which we currently have stored in our token
-            strcpy(ci->code, token);
-
-            //Set Base Values for sum/incrementing
-            ci->num_records = 0;
-            ci->totalHumidity = 0;
-            ci->totalCloudCover = 0;
-            ci->lightningStrikeCount = 0;
-            ci->snowCoverCount = 0;
-            ci->totalTemp = 0;
-            //Set both cases to extremes to act as sudo infinity
-            ci->maxTemp = -1000;
-            ci->minTemp = 1000;
-
-            //Our index function cannot return a negative when the index is zero, so we use a special case of -50
-            //to trip the negative flag. We handle this special case by just setting it back to zero.
-            //For all other cases we flip the sign
-            if (index == -50) {
-                index = 0;
-            } else index = -index;
-            //Once we know the index we can put the pointer into our states array
-            states[index] = ci;
-        }
-        //We grab the state we are going to edit based on the index
-        ci = states[index];
-
-        //For every record we increment its states record count
-        ci->num_records++;
-
-        //Second token is the Timestamp
-        //We store this token for later in case it's needed for the max/min temp
-        token = strtok(NULL, delim);
-        const unsigned long currentTS = atol(token) / 1000;
-
-        //Third token is the GeoLocation- This is irrelevant to our data output, so we ignore it
-        token = strtok(NULL, delim);
-
-        //4th token is avg humidity
-        token = strtok(NULL, delim);
-        ci->totalHumidity += atof(token);
-
-        //5th token
-        token = strtok(NULL, delim);
-        if (*token == '1') {
-            ci->snowCoverCount++;
-        }
-
-        //6th token is cloud cover- Same as avg humid
-        token = strtok(NULL, delim);
-        ci->totalCloudCover += atof(token);
-
-        //7th token is lightning strikes
-        token = strtok(NULL, delim);
-        if (*token == '1') {
-            ci->lightningStrikeCount++;
-        }
-
-        //8- Pressure - Not used
-        token = strtok(NULL, delim);
-
-        //9- Temp
-        token = strtok(NULL, delim);
-        double temp = atof(token) * 1.8 - 459.67;
-        ci->totalTemp += temp;
-        //Max
-        if (temp > ci->maxTemp) {
-            ci->maxTemp = temp;
-            strcpy(ci->maxTempDate, ctime(&currentTS));
-
-
-        }
-        //Min
-        if (temp < ci->minTemp) {
-            ci->minTemp = temp;
-            strcpy(ci->minTempDate, ctime(&currentTS));
-        }
-    }
-}
-
-void print_report(struct climate_info *states[], int num_states) {
-    printf("States found:\n");
-    int i;
-    for (i = 0; i < num_states; ++i) {
-        if (states[i] != NULL) {
-            struct climate_info *info = states[i];
-            printf("%s ", info->code);
-        }
-    }
-    printf("\n");
+/**
+ * Merges one running stat into another.
+ * @param s - Stat merged into
+ * @param n - Number of values in s
+ * @param other - Stat merged from
+ * @param other_n - Number of values in other
+ */
+static void stat_merge(struct running_stat *s, unsigned long long n, const struct running_stat *other,
+                       unsigned long long other_n) {
+    if (other_n == 0) return;
+    const double total = (double) n + (double) other_n;
+    const double delta = stat_mean(other, other_n) - stat_mean(s, n);
+    s->m2 += other->m2 + delta * delta * ((double) n * (double) other_n / total);
+    stat_sum(s, other->sum);
+    s->comp += other->comp;
+}
 
-    for (i = 0; i < num_states; i++) {
-        if (states[i] != NULL) {
-            struct climate_info *info = states[i];
-            printf("-- State: %s --\n", info->code);
-            printf("Number of Records: %llu\n", info->num_records);
-            printf("Average Humidity: %.1f%%\n", info->totalHumidity / info->num_records);
-            printf("Average Temperature: %.1fF\n", info->totalTemp / info->num_records);
-            printf("Max Temperature: %.1fF\n", info->maxTemp);
-            printf("Max Temperature on: %s", info->maxTempDate);
-            printf("Min Temperature: %.1fF\n", info->minTemp);
-            printf("Min Temperature on: %s", info->minTempDate);
-            printf("Lightning Strikes: %d\n", info->lightningStrikeCount);
-            printf("Records with Snow Cover: %d\n", info->snowCoverCount);
-            printf("Average Cloud Cover: %.1f%%\n", info->totalCloudCover / info->num_records);
-        }
+/**
+ * @param s - Running stat
+ * @param n - Number of values in s
+ * @return Sample standard deviation of the values, 0 for fewer than two
+ */
+static double stat_stddev(const struct running_stat *s, unsigned long long n) {
+    if (n < 2 || s->m2 <= 0) return 0;
+    //Newton's method, so the required build doesn't need libm for one square root per line of the report
+    const double var = s->m2 / (double) (n - 1);
+    double root = var > 1 ? var : 1;
+    for (int i = 0; i < 100; i++) {
+        const double next = 0.5 * (root + var / root);
+        if (next >= root) break;
+        root = next;
     }
-    printf("\n");
+    return root;
+}
+
+/**
+ * @return Histogram bin of a temperature in Fahrenheit, see TEMP_SKETCH_BINS
+ */
+static int temp_bin(double temp) {
+    if (!(temp >= TEMP_SKETCH_LOW)) return 0;
+    if (temp >= TEMP_SKETCH_HIGH) return TEMP_SKETCH_BINS - 1;
+    return 1 + (int) ((temp - TEMP_SKETCH_LOW) * TEMP_SKETCH_STEP);
+}
+
+/**
+ * Adds the counts of one temperature histogram to another. Merging is exact, so the quantiles don't depend on
+ * how the records were split between threads, tasks or runs.
+ * @param dst - Histogram added to, nothing happens if it's NULL
+ * @param src - Histogram added from, nothing happens if it's NULL
+ */
+static void sketch_merge(uint64_t *dst, const uint64_t *src) {
+    if (dst == NULL || src == NULL) return;
+    for (int b = 0; b < TEMP_SKETCH_BINS; b++) dst[b] += src[b];
+}
+
+/**
+ * Estimates a quantile of the temperatures of a state from its histogram, by the nearest rank. The estimate is the
+ * middle of the bin the rank falls in, so it is within half a bin (0.05F) of the exact value, and temperatures
+ * outside the binned range are the exact min or max.
+ * @param bins - Histogram of the state
+ * @param n - Number of temperatures in the histogram
+ * @param q - The quantile, between 0 and 1
+ * @param minTemp - Lowest temperature of the state
+ * @param maxTemp - Highest temperature of the state
+ * @return The estimate in Fahrenheit
+ */
+static double temp_quantile(const uint64_t *bins, unsigned long long n, double q, double minTemp, double maxTemp) {
+    //Nearest rank is ceil(q * n), counted from 1
+    unsigned long long rank = (unsigned long long) (q * (double) n);
+    if ((double) rank < q * (double) n || rank == 0) rank++;
+    unsigned long long seen = 0;
+    int b = 0;
+    while (b < TEMP_SKETCH_BINS - 1 && (seen += bins[b]) < rank) b++;
+    if (b == 0) return minTemp;
+    if (b == TEMP_SKETCH_BINS - 1) return maxTemp;
+    const double value = TEMP_SKETCH_LOW + (b - 0.5) / TEMP_SKETCH_STEP;
+    return value < minTemp ? minTemp : value > maxTemp ? maxTemp : value;
+}
+
+/**
+ * Sets a summary to an empty one
+ * @param ci - Summary to clear, its code is left alone
+ */
+static void init_climate_info(struct climate_info *ci) {
+    //Set Base Values for sum/incrementing
+    ci->num_records = 0;
+    ci->humidity.sum = ci->humidity.comp = ci->humidity.m2 = 0;
+    ci->cloudCover.sum = ci->cloudCover.comp = ci->cloudCover.m2 = 0;
+    ci->lightningStrikeCount = 0;
+    ci->snowCoverCount = 0;
+    ci->temp.sum = ci->temp.comp = ci->temp.m2 = 0;
+    //Set both cases to extremes to act as sudo infinity
+    ci->maxTemp = -1000;
+    ci->minTemp = 1000;
+    ci->maxTempTS = 0;
+    ci->minTempTS = 0;
+}
+
+/**
+ * Looks up a state by its key, creating an empty summary for it the first time it is seen.
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param key - Key of the state from state_key
+ * @return Number of the state, which indexes the arrays of the table
+ */
+int stateFromKey(struct state_table *states, int key) {
+    //Fast path, one load tells us where the state lives
+    if (states->slot[key] != 0) return states->slot[key] - 1;
+
+    const int i = states->num_states;
+    //The code is rebuilt from the key so it is always terminated
+    states->codes[i][0] = (char) ('A' + key / 26);
+    states->codes[i][1] = (char) ('A' + key % 26);
+    states->codes[i][2] = '\0';
+
+    //Set Base Values for sum/incrementing
+    struct state_columns *totals = &states->totals;
+    totals->num_records[i] = 0;
+    totals->folded[i] = 0;
+    totals->temp[i].sum = totals->temp[i].comp = totals->temp[i].m2 = 0;
+    totals->humidity[i].sum = totals->humidity[i].comp = totals->humidity[i].m2 = 0;
+    totals->cloudCover[i].sum = totals->cloudCover[i].comp = totals->cloudCover[i].m2 = 0;
+    //The first batch is shifted by a typical value, later ones by the mean so far
+    totals->tempShift[i] = 50;
+    totals->humidityShift[i] = 50;
+    totals->cloudCoverShift[i] = 50;
+    totals->tempTotal[i] = totals->tempSum[i] = totals->tempSq[i] = 0;
+    totals->humidityTotal[i] = totals->humiditySum[i] = totals->humiditySq[i] = 0;
+    totals->cloudCoverTotal[i] = totals->cloudCoverSum[i] = totals->cloudCoverSq[i] = 0;
+    totals->lightningStrikeCount[i] = 0;
+    totals->snowCoverCount[i] = 0;
+    //Set both cases to extremes to act as sudo infinity
+    totals->maxTemp[i] = -1000;
+    totals->minTemp[i] = 1000;
+    totals->maxTempTS[i] = 0;
+    totals->minTempTS[i] = 0;
+    totals->tempBins[i] = arena_alloc(&states->arena, TEMP_SKETCH_BINS * sizeof(uint64_t));
+    if (totals->tempBins[i] != NULL) memset(totals->tempBins[i], 0, TEMP_SKETCH_BINS * sizeof(uint64_t));
+
+    //New states go to the end so the report keeps first-seen order
+    states->num_states++;
+    states->slot[key] = (unsigned short) states->num_states;
+    return i;
 }
 
+/**
+ * Copies the totals of one state out of the table.
+ * @param states - Table containing the state
+ * @param i - Number of the state
+ * @param ci - Receives the code and totals of the state
+ */
+static void state_summary(const struct state_table *states, int i, struct climate_info *ci) {
+    const struct state_columns *totals = &states->totals;
+    memcpy(ci->code, states->codes[i], sizeof(ci->code));
+    ci->num_records = totals->num_records[i];
+    ci->temp = totals->temp[i];
+    ci->humidity = totals->humidity[i];
+    ci->cloudCover = totals->cloudCover[i];
+    ci->maxTemp = totals->maxTemp[i];
+    ci->maxTempTS = totals->maxTempTS[i];
+    ci->minTemp = totals->minTemp[i];
+    ci->minTempTS = totals->minTempTS[i];
+    ci->lightningStrikeCount = totals->lightningStrikeCount[i];
+    ci->snowCoverCount = totals->snowCoverCount[i];
+}
+
+/**
+ * Folds a summary into the totals of one state.
+ * @param states - Table containing the state
+ * @param i - Number of the state
+ * @param src - Summary merged from
+ */
+static void add_summary(struct state_table *states, int i, const struct climate_info *src) {
+    struct state_columns *totals = &states->totals;
+    stat_merge(&totals->temp[i], totals->num_records[i], &src->temp, src->num_records);
+    stat_merge(&totals->humidity[i], totals->num_records[i], &src->humidity, src->num_records);
+    stat_merge(&totals->cloudCover[i], totals->num_records[i], &src->cloudCover, src->num_records);
+    totals->num_records[i] += src->num_records;
+    totals->tempShift[i] = stat_mean(&totals->temp[i], totals->num_records[i]);
+    totals->humidityShift[i] = stat_mean(&totals->humidity[i], totals->num_records[i]);
+    totals->cloudCoverShift[i] = stat_mean(&totals->cloudCover[i], totals->num_records[i]);
+    totals->folded[i] = totals->num_records[i];
+    totals->lightningStrikeCount[i] += src->lightningStrikeCount;
+    totals->snowCoverCount[i] += src->snowCoverCount;
+    if (src->maxTemp > totals->maxTemp[i]) {
+        totals->maxTemp[i] = src->maxTemp;
+        totals->maxTempTS[i] = src->maxTempTS;
+    }
+    if (src->minTemp < totals->minTemp[i]) {
+        totals->minTemp[i] = src->minTemp;
+        totals->minTempTS[i] = src->minTempTS;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    COUNTER_START(started);
+
+    //Number of threads used to parse each mapped file, set with -j N
+    int num_threads = 1;
+    //Number of workers analyzing byte ranges of every file at the same time, set with -P N
+    int file_workers = 1;
+    //Number of benchmark iterations, zero for a normal run. Set with --bench or --bench=N
+    int bench_iterations = 0;
+    //Columnar cache file to write instead of printing a report, set with --convert=PATH
+    const char *convert_path = NULL;
+    //Checkpoint to resume from and save to, set with --checkpoint=PATH
+    const char *checkpoint_path = NULL;
+    //Time buckets to summarize each state by as well, set with --bucket=hour|day|month
+    enum bucket_size bucket = BUCKET_NONE;
+    //Length of the geohash prefix to group records by as well, set with --geohash=N
+    int geohash = 0;
+    //Metrics to report, set with --metrics=humidity,temp,cloud,snow,lightning
+    unsigned metrics = METRIC_ALL;
+    //How the report is written, set with --format=csv|json|binary
+    enum output_format format = FORMAT_TEXT;
+    //Set by --merge, the files are binary summaries of other runs instead of TDV files
+    int merge = 0;
+    //Set by --index, TDV files are read through a sidecar zone map index that is built on the first run
+    int indexed = 0;
+    //Records to keep, set with --states=CODE,... and --from=TIME / --to=TIME in Unix seconds
+    static struct record_filter filter = {0, {0}, LONG_MIN, LONG_MAX};
+    int filtering = 0;
+    int first_file = 1;
+    while (first_file < argc && argv[first_file][0] == '-') {
+        const char *arg = argv[first_file];
+        if (strncmp(arg, "-j", 2) == 0) {
+            const char *count = arg[2] != '\0' ? arg + 2 : argv[++first_file];
+            num_threads = count != NULL ? atoi(count) : 0;
+            if (num_threads < 1 || num_threads > MAX_THREADS) {
+                printf("Thread count must be between 1 and %d\n", MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(arg, "-P", 2) == 0) {
+            const char *count = arg[2] != '\0' ? arg + 2 : argv[++first_file];
+            file_workers = count != NULL ? atoi(count) : 0;
+            if (file_workers < 1 || file_workers > MAX_THREADS) {
+                printf("File worker count must be between 1 and %d\n", MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(arg, "--bench") == 0) {
+            bench_iterations = BENCH_ITERATIONS;
+        } else if (strncmp(arg, "--bench=", 8) == 0) {
+            bench_iterations = atoi(arg + 8);
+            if (bench_iterations < 1) {
+                printf("Benchmark iterations must be at least 1\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(arg, "--convert=", 10) == 0 && arg[10] != '\0') {
+            convert_path = arg + 10;
+        } else if (strncmp(arg, "--checkpoint=", 13) == 0 && arg[13] != '\0') {
+            checkpoint_path = arg + 13;
+        } else if (strncmp(arg, "--bucket=", 9) == 0) {
+            if (strcmp(arg + 9, "hour") == 0) {
+                bucket = BUCKET_HOUR;
+            } else if (strcmp(arg + 9, "day") == 0) {
+                bucket = BUCKET_DAY;
+            } else if (strcmp(arg + 9, "month") == 0) {
+                bucket = BUCKET_MONTH;
+            } else {
+                printf("Bucket size must be hour, day or month\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(arg, "--geohash=", 10) == 0) {
+            char *end;
+            const long n = strtol(arg + 10, &end, 10);
+            if (end == arg + 10 || *end != '\0' || n < 1 || n > MAX_GEOHASH) {
+                printf("Geohash precision must be between 1 and %d\n", MAX_GEOHASH);
+                return EXIT_FAILURE;
+            }
+            geohash = (int) n;
+        } else if (strncmp(arg, "--states=", 9) == 0) {
+            filter.by_state = 1;
+            filtering = 1;
+            for (const char *p = arg + 9; *p != '\0';) {
+                const size_t len = strcspn(p, ",");
+                const int key = state_key(p, len);
+                if (key < 0) {
+                    printf("States must be a comma separated list of two letter state codes\n");
+                    return EXIT_FAILURE;
+                }
+                filter.keep[key] = 1;
+                p += len + (p[len] == ',');
+            }
+        } else if (strncmp(arg, "--from=", 7) == 0 || strncmp(arg, "--to=", 5) == 0) {
+            const char *time = strchr(arg, '=') + 1;
+            char *end;
+            errno = 0;
+            const long t = strtol(time, &end, 10);
+            if (end == time || *end != '\0' || errno != 0) {
+                printf("--from and --to take a Unix time in seconds\n");
+                return EXIT_FAILURE;
+            }
+            if (arg[2] == 'f') {
+                filter.from = t;
+            } else filter.to = t;
+            filtering = 1;
+        } else if (strcmp(arg, "--index") == 0) {
+            indexed = 1;
+        } else if (strcmp(arg, "--merge") == 0) {
+            merge = 1;
+        } else if (strncmp(arg, "--format=", 9) == 0) {
+            if (strcmp(arg + 9, "text") == 0) {
+                format = FORMAT_TEXT;
+            } else if (strcmp(arg + 9, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp(arg + 9, "json") == 0) {
+                format = FORMAT_JSON;
+            } else if (strcmp(arg + 9, "binary") == 0) {
+                format = FORMAT_BINARY;
+            } else {
+                printf("Format must be text, csv, json or binary\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(arg, "--metrics=", 10) == 0) {
+            static const char *const names[] = {"humidity", "temp", "cloud", "snow", "lightning"};
+            metrics = 0;
+            for (const char *p = arg + 10; *p != '\0';) {
+                const size_t len = strcspn(p, ",");
+                unsigned m = 0;
+                for (unsigned k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+                    if (strlen(names[k]) == len && strncmp(p, names[k], len) == 0) m = 1u << k;
+                }
+                if (m == 0) {
+                    printf("Metrics must be a comma separated list of humidity, temp, cloud, snow and lightning\n");
+                    return EXIT_FAILURE;
+                }
+                metrics |= m;
+                p += len + (p[len] == ',');
+            }
+        } else break; //Not an option we know, treat it as the first file
+        first_file++;
+    }
+
+    char **files = argv + first_file;
+    int num_files = argc - first_file;
+    //With no files we read stdin, unless it's a terminal and nothing is being piped in
+    static char *stdin_only[] = {"-"};
+    if (num_files == 0 && bench_iterations == 0 && !isatty(STDIN_FILENO)) {
+        files = stdin_only;
+        num_files = 1;
+    }
+
+    if (num_files == 0) { //Check for at least one data file
+        printf("Usage: %s [-j threads] [-P workers] [--bench[=iterations]] [--convert=out_file] [--checkpoint=file] "
+               "[--bucket=hour|day|month] [--geohash=precision] [--metrics=list] [--format=text|csv|json|binary] "
+               "[--merge] [--states=CODE,...] [--from=time] [--to=time] [--index] "
+               "tdv_file1 tdv_file2 ... tdv_fileN \n", argv[0]);
+        printf("Use - as a file name to read from stdin\n");
+        return EXIT_FAILURE;
+    }
+
+    if (bench_iterations > 0) {
+        return run_benchmark(files, num_files, bench_iterations, num_threads);
+    }
+
+    /* Let's create a table to store our state data in. It has room for every
+     * two letter state code, so territories fit as well as the 50 states. */
+    static struct state_table states;
+    states.bucket = bucket;
+    states.geohash = geohash;
+    states.hidden_metrics = METRIC_ALL & ~metrics;
+    //Converting, checkpoints and the machine readable formats keep every field, since write_summaries writes
+    //every metric. The report still only shows the chosen metrics
+    const int keep_all = convert_path != NULL || checkpoint_path != NULL || format != FORMAT_TEXT;
+    states.skip_fields = projection_skip(keep_all ? METRIC_ALL : metrics, bucket, geohash);
+    states.decode = select_decoder(states.skip_fields);
+
+    if (format != FORMAT_TEXT && (convert_path != NULL || bucket != BUCKET_NONE || geohash > 0)) {
+        printf("--format only writes the state summaries, it can't be used with --convert, --bucket or --geohash\n");
+        return EXIT_FAILURE;
+    }
+    if (merge && (convert_path != NULL || checkpoint_path != NULL || bucket != BUCKET_NONE || geohash > 0)) {
+        printf("--merge can't be combined with --convert, --checkpoint, --bucket or --geohash\n");
+        return EXIT_FAILURE;
+    }
+    if (filtering && (merge || checkpoint_path != NULL)) {
+        //A checkpoint holds the summaries of everything up to its offsets, it can't be resumed with other filters
+        printf("--states, --from and --to can't be combined with --merge or --checkpoint\n");
+        return EXIT_FAILURE;
+    }
+    if (filtering) states.filter = &filter;
+    states.indexed = indexed;
+    //Machine readable output goes to stdout alone, so the progress messages move to stderr
+    FILE *progress = format == FORMAT_TEXT ? stdout : stderr;
+
+    if (convert_path != NULL) {
+        states.convert = column_writer_open(convert_path);
+        if (states.convert == NULL) {
+            printf("Error creating %s\n", convert_path);
+            return EXIT_FAILURE;
+        }
+        //Records have to reach the writer in file order
+        num_threads = 1;
+    }
+
+    struct checkpoint checkpoint = {NULL, 0, 0};
+    if (checkpoint_path != NULL) {
+        if (convert_path != NULL || bucket != BUCKET_NONE || geohash > 0) {
+            printf("--checkpoint can't be combined with --convert, --bucket or --geohash\n");
+            return EXIT_FAILURE;
+        }
+        if (load_checkpoint(checkpoint_path, &states, &checkpoint) != 0) {
+            printf("Error reading checkpoint %s\n", checkpoint_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (merge) {
+        for (int i = 0; i < num_files; i++) {
+            fprintf(progress, "Opening file: %s\n", files[i]);
+            const int status = merge_summary_file(files[i], &states);
+            if (status == FILE_MISSING) fprintf(progress, "Error File # %d doesn't exist!\n", i + 1);
+            if (status == FILE_FAILED) fprintf(progress, "Error reading file # %d\n", i + 1);
+        }
+    } else if (file_workers > 1 && states.convert == NULL && checkpoint_path == NULL) {
+        //Converting has to see records in file order and a checkpoint is one set of offsets, so both stay serial
+        analyze_files_parallel(files, num_files, &states, file_workers, progress);
+    } else {
+        for (int i = 0; i < num_files; i++) {
+            fprintf(progress, "Opening file: %s\n", files[i]);
+            const int status = analyze_path(files[i], &states, num_threads,
+                                            checkpoint_path != NULL ? &checkpoint : NULL);
+            if (status == FILE_MISSING) fprintf(progress, "Error File # %d doesn't exist!\n", i + 1);
+            if (status == FILE_FAILED) fprintf(progress, "Error reading file # %d\n", i + 1);
+        }
+    }
+
+    if (states.convert != NULL) {
+        unsigned long long written;
+        if (column_writer_close(states.convert, &written) != 0) {
+            printf("Error writing %s\n", convert_path);
+            return EXIT_FAILURE;
+        }
+        printf("Converted %llu records to %s\n", written, convert_path);
+        if (states.malformed > 0) fprintf(stderr, "Skipped %llu malformed line(s)\n", states.malformed);
+#ifdef CLIMATE_COUNTERS
+        print_counters(stderr, &states, started);
+#endif
+        return 0;
+    }
+
+    if (checkpoint_path != NULL) {
+        if (save_checkpoint(checkpoint_path, &states, &checkpoint) != 0) {
+            printf("Error writing checkpoint %s\n", checkpoint_path);
+        }
+        //Records without a newline yet are reported now but parsed again next run, once they are complete
+        finish_checkpoint(&checkpoint, &states);
+    }
+
+    /* Now that we have recorded data for each file, we'll summarize them: */
+    int status = 0;
+    if (format != FORMAT_TEXT) {
+        fflush(stdout);
+        if (write_summaries(STDOUT_FILENO, &states, format) != 0) {
+            fprintf(stderr, "Error writing the summaries\n");
+            status = EXIT_FAILURE;
+        }
+    } else print_report(stdout, &states);
+    if (states.bucket != BUCKET_NONE) print_buckets(stdout, &states);
+    if (states.unbucketed > 0) {
+        fprintf(stderr, "Left %llu record(s) out of the time buckets, they are too far in time from the rest of "
+                        "their state\n", states.unbucketed);
+    }
+    if (states.geohash > 0) print_cells(stdout, &states);
+    if (states.ungrouped > 0) {
+        fprintf(stderr, "Left %llu record(s) out of the geohash cells, their geohash is too short or not valid\n",
+                states.ungrouped);
+    }
+    if (states.malformed > 0) fprintf(stderr, "Skipped %llu malformed line(s)\n", states.malformed);
+#ifdef CLIMATE_COUNTERS
+    print_counters(stderr, &states, started);
+#endif
+    free_states(&states);
+
+    return status;
+}
+
+/**
+ * Hands a filled slot over to the parser, or parses it right away when the reader isn't threaded.
+ * @param pf - The prefetcher
+ * @param slot - The slot
+ */
+static void prefetch_publish(struct prefetcher *pf, struct prefetch_slot *slot) {
+    if (!pf->threaded) {
+        pf->states->malformed += slot->dropped;
+        analyze_buffer(slot->buf + slot->start, slot->end - slot->start, pf->states);
+        return;
+    }
+    pthread_mutex_lock(&pf->lock);
+    slot->full = 1;
+    pthread_cond_broadcast(&pf->changed);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/**
+ * Waits until the parser is done with a slot, so it can be filled again.
+ * @param pf - The prefetcher
+ * @param slot - The slot
+ */
+static void prefetch_wait_empty(struct prefetcher *pf, struct prefetch_slot *slot) {
+    if (!pf->threaded) return;
+    pthread_mutex_lock(&pf->lock);
+    while (slot->full) pthread_cond_wait(&pf->changed, &pf->lock);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/**
+ * Reads the whole stream of a prefetcher into its slots, in ring order.
+ * @param arg - The prefetcher
+ * @return NULL
+ */
+static void *prefetch_reader(void *arg) {
+    struct prefetcher *pf = arg;
+    int s = 0;
+    //Bytes of an unfinished record carried over from the previous read
+    size_t kept = 0;
+    //Set while we drop the rest of a record that didn't fit in the buffer
+    int skipping = 0;
+    //Set until the first read, which is checked for a columnar file
+    int first = 1;
+    unsigned long long dropped = 0;
+
+    for (;;) {
+        char *buf = pf->slots[s].buf;
+        COUNTER_START(reading);
+        ssize_t got = read(pf->fd, buf + kept, READ_BUF_SZ - kept);
+        COUNTER_STOP(pf, io_ns, reading);
+        if (got < 0) {
+            pf->status = -1;
+            break;
+        }
+        if (got == 0) break; //End of the stream
+        size_t start = 0;
+        const size_t filled = kept + (size_t) got;
+        if (first && filled >= sizeof(COLUMN_MAGIC) - 1 && memcmp(buf, COLUMN_MAGIC, sizeof(COLUMN_MAGIC) - 1) == 0) {
+            fprintf(stderr, "Columnar cache files have to be given by path, they can't be streamed\n");
+            pf->status = -1;
+            break;
+        }
+        first = 0;
+
+        if (skipping) {
+            const char *nl = memchr(buf, '\n', filled);
+            if (nl == NULL) {
+                kept = 0;
+                continue;
+            }
+            start = (size_t) (nl - buf) + 1;
+            skipping = 0;
+        }
+
+        //Only complete records are analyzed now, the rest waits for the next read
+        size_t complete = filled;
+        while (complete > start && buf[complete - 1] != '\n') complete--;
+        if (complete == start && filled - start == READ_BUF_SZ) {
+            //A record longer than the whole buffer can't be a real record, drop it up to its newline
+            dropped++;
+            skipping = 1;
+            kept = 0;
+            continue;
+        }
+
+        pf->slots[s].start = start;
+        pf->slots[s].end = complete;
+        pf->slots[s].dropped = dropped;
+        dropped = 0;
+        prefetch_publish(pf, &pf->slots[s]);
+        //The slot being parsed is only read from, so its tail can be copied out meanwhile
+        const int next = (s + 1) % PREFETCH_SLOTS;
+        prefetch_wait_empty(pf, &pf->slots[next]);
+        kept = filled - complete;
+        memcpy(pf->slots[next].buf, buf + complete, kept);
+        s = next;
+    }
+    //Whatever is left is a last record without a newline
+    if (skipping) kept = 0;
+    if (kept > 0 || dropped > 0) {
+        pf->slots[s].start = 0;
+        pf->slots[s].end = kept;
+        pf->slots[s].dropped = dropped;
+        prefetch_publish(pf, &pf->slots[s]);
+    }
+
+    if (pf->threaded) {
+        pthread_mutex_lock(&pf->lock);
+        pf->done = 1;
+        pthread_cond_broadcast(&pf->changed);
+        pthread_mutex_unlock(&pf->lock);
+    }
+    return NULL;
+}
+
+int analyze_file(int fd, struct state_table *states) {
+    struct prefetcher *pf = calloc(1, sizeof(*pf));
+    if (pf == NULL) return -1;
+    int status = 0;
+    for (int s = 0; s < PREFETCH_SLOTS; s++) {
+        pf->slots[s].buf = malloc(READ_BUF_SZ);
+        if (pf->slots[s].buf == NULL) status = -1;
+    }
+
+    if (status == 0) {
+        pf->fd = fd;
+        pf->states = states;
+        pthread_mutex_init(&pf->lock, NULL);
+        pthread_cond_init(&pf->changed, NULL);
+        //Set before the reader starts, since it checks the flag right away
+        pf->threaded = 1;
+        pthread_t reader;
+        if (pthread_create(&reader, NULL, prefetch_reader, pf) == 0) {
+            //Parse the slots in the order the reader fills them until it's done and none are left
+            for (int s = 0;; s = (s + 1) % PREFETCH_SLOTS) {
+                struct prefetch_slot *slot = &pf->slots[s];
+                pthread_mutex_lock(&pf->lock);
+                while (!slot->full && !pf->done) pthread_cond_wait(&pf->changed, &pf->lock);
+                const int full = slot->full;
+                pthread_mutex_unlock(&pf->lock);
+                if (!full) break;
+
+                states->malformed += slot->dropped;
+                analyze_buffer(slot->buf + slot->start, slot->end - slot->start, states);
+                pthread_mutex_lock(&pf->lock);
+                slot->full = 0;
+                pthread_cond_broadcast(&pf->changed);
+                pthread_mutex_unlock(&pf->lock);
+            }
+            pthread_join(reader, NULL);
+        } else {
+            pf->threaded = 0;
+            prefetch_reader(pf);
+        }
+        pthread_mutex_destroy(&pf->lock);
+        pthread_cond_destroy(&pf->changed);
+        COUNTER_ADD(states, io_ns, pf->counters.io_ns);
+        status = pf->status;
+    }
+
+    for (int s = 0; s < PREFETCH_SLOTS; s++) free(pf->slots[s].buf);
+    free(pf);
+    return status;
+}
+
+const char *map_file(int fd, size_t *len) {
+    struct stat st;
+    //Only regular files can be mapped, and mmap refuses a zero length mapping
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return NULL;
+
+    *len = (size_t) st.st_size;
+    void *map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return NULL;
+    //We read the file front to back exactly once
+    posix_madvise(map, *len, POSIX_MADV_SEQUENTIAL);
+    return map;
+}
+
+int analyze_mapping(const char *map, size_t len, struct state_table *states, int num_threads) {
+    if (len >= sizeof(COLUMN_MAGIC) - 1 && memcmp(map, COLUMN_MAGIC, sizeof(COLUMN_MAGIC) - 1) == 0) {
+        return analyze_columnar(map, len, states);
+    }
+    if (num_threads > 1) {
+        analyze_parallel(map, len, states, num_threads);
+    } else analyze_buffer(map, len, states);
+    return 0;
+}
+
+/**
+ * Works out the zone map of one block of a TDV file. The state and timestamp of a line are its first two non
+ * empty fields, the same as the parser splits them.
+ * @param map - Start of the file
+ * @param zone - Block to fill in, offset and len must be set
+ */
+static void index_zone(const char *map, struct index_block *zone) {
+    zone->min_timestamp = INT64_MAX;
+    zone->max_timestamp = INT64_MIN;
+    zone->flags = 0;
+    zone->reserved = 0;
+    memset(zone->states_present, 0, sizeof(zone->states_present));
+    const char *p = map + zone->offset;
+    const char *end = p + zone->len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t) (end - p));
+        const char *eol = nl != NULL ? nl : end;
+        struct field fields[2];
+        int n = 0;
+        const char *q = p;
+        while (n < 2 && q < eol) {
+            while (q < eol && *q == '\t') q++;
+            //Also keeps GCC from seeing a bound that could be negative when it inlines this with LTO
+            if (q >= eol) break;
+            const char *tab = memchr(q, '\t', (size_t) (eol - q));
+            const char *stop = tab != NULL ? tab : eol;
+            if (stop > q) {
+                fields[n].ptr = q;
+                fields[n].len = (size_t) (stop - q);
+                n++;
+            }
+            q = stop;
+        }
+        long timestamp;
+        const int key = n == 2 && q < eol ? state_key(fields[0].ptr, fields[0].len) : -1;
+        if (key >= 0 && parse_long(fields[1].ptr, fields[1].len, &timestamp)) {
+            if (timestamp < zone->min_timestamp) zone->min_timestamp = timestamp;
+            if (timestamp > zone->max_timestamp) zone->max_timestamp = timestamp;
+            zone->states_present[key / 64] |= 1ULL << (key % 64);
+        } else if (n > 0) {
+            //The parser counts the line as malformed unless a filter rejects it, so the block has to be read
+            zone->flags |= INDEX_UNPARSED;
+        }
+        p = eol + 1;
+    }
+}
+
+/**
+ * Builds the index of a TDV file.
+ * @param map - Start of the file
+ * @param len - Size of the file
+ * @param num_blocks - Receives the number of blocks
+ * @return The blocks, or NULL if out of memory
+ */
+static struct index_block *build_index(const char *map, size_t len, size_t *num_blocks) {
+    size_t capacity = len / INDEX_BLOCK_SZ + 1;
+    struct index_block *blocks = malloc(capacity * sizeof(*blocks));
+    *num_blocks = 0;
+    for (size_t offset = 0; offset < len && blocks != NULL;) {
+        if (*num_blocks == capacity) {
+            struct index_block *bigger = realloc(blocks, capacity * 2 * sizeof(*blocks));
+            if (bigger == NULL) {
+                free(blocks);
+                return NULL;
+            }
+            blocks = bigger;
+            capacity *= 2;
+        }
+        //Cut after the first newline past INDEX_BLOCK_SZ, so every block is whole lines
+        const size_t left = len - offset;
+        const char *cut = left > INDEX_BLOCK_SZ ? memchr(map + offset + INDEX_BLOCK_SZ, '\n', left - INDEX_BLOCK_SZ)
+                                                : NULL;
+        struct index_block *zone = &blocks[(*num_blocks)++];
+        zone->offset = offset;
+        zone->len = cut != NULL ? (size_t) (cut - (map + offset)) + 1 : left;
+        index_zone(map, zone);
+        offset += zone->len;
+    }
+    return blocks;
+}
+
+/**
+ * Writes an index next to its TDV file, through a temporary file so a reader never sees half of one. Failing to
+ * write it, in a read only directory for instance, isn't an error, the file is just indexed again next time.
+ */
+static void save_index(const char *index_path, const struct stat *st, const struct index_block *blocks,
+                       size_t num_blocks) {
+    const size_t len = strlen(index_path);
+    char *temp = malloc(len + 5);
+    if (temp == NULL) return;
+    memcpy(temp, index_path, len);
+    memcpy(temp + len, ".tmp", 5);
+
+    struct index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.byte_order = COLUMN_BYTE_ORDER;
+    header.file_size = (uint64_t) st->st_size;
+    header.mtime_sec = (int64_t) st->st_mtim.tv_sec;
+    header.mtime_nsec = (int64_t) st->st_mtim.tv_nsec;
+    header.num_blocks = num_blocks;
+    FILE *file = fopen(temp, "wb");
+    if (file != NULL) {
+        int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+        failed |= fwrite(blocks, sizeof(*blocks), num_blocks, file) != num_blocks;
+        failed |= fclose(file) != 0;
+        if (failed || rename(temp, index_path) != 0) remove(temp);
+    }
+    free(temp);
+}
+
+/**
+ * Checks that a mapped index matches its TDV file and covers all of it.
+ * @return The blocks of the index, or NULL if it's damaged or stale
+ */
+static const struct index_block *check_index(const char *map, size_t len, const struct stat *st,
+                                             size_t *num_blocks) {
+    const struct index_header *header = (const struct index_header *) map;
+    if (len < sizeof(*header) || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+        || header->version != INDEX_VERSION || header->byte_order != COLUMN_BYTE_ORDER
+        || header->file_size != (uint64_t) st->st_size || header->mtime_sec != (int64_t) st->st_mtim.tv_sec
+        || header->mtime_nsec != (int64_t) st->st_mtim.tv_nsec
+        || header->num_blocks > (len - sizeof(*header)) / sizeof(struct index_block)
+        || len != sizeof(*header) + header->num_blocks * sizeof(struct index_block)) {
+        return NULL;
+    }
+    const struct index_block *blocks = (const struct index_block *) (header + 1);
+    uint64_t offset = 0;
+    for (uint64_t b = 0; b < header->num_blocks; b++) {
+        if (blocks[b].offset != offset || blocks[b].len == 0) return NULL;
+        offset += blocks[b].len;
+    }
+    if (offset != header->file_size) return NULL;
+    *num_blocks = (size_t) header->num_blocks;
+    return blocks;
+}
+
+/**
+ * @return 1 if a block may hold records the filter keeps, 0 if it can be skipped
+ */
+static int zone_matches(const struct index_block *zone, const struct record_filter *filter) {
+    if (zone->flags & INDEX_UNPARSED) return 1;
+    if (zone->min_timestamp > zone->max_timestamp) return 0; //Only empty lines
+    if (filter == NULL) return 1;
+    if (zone->max_timestamp / 1000 < filter->from || zone->min_timestamp / 1000 >= filter->to) return 0;
+    if (!filter->by_state) return 1;
+    for (int w = 0; w < INDEX_STATE_WORDS; w++) {
+        for (uint64_t bits = zone->states_present[w]; bits != 0; bits &= bits - 1) {
+            if (filter->keep[w * 64 + __builtin_ctzll(bits)]) return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Finds the parts of a mapped TDV file worth reading with --index, loading its sidecar index or building and
+ * saving one when it's missing or stale. Neighbouring blocks that match the filter are joined into one range,
+ * the mapping is told to expect random access and the ranges are read ahead.
+ * @param path - Path of the file
+ * @param fd - Open descriptor of the file
+ * @param map - Mapping of the whole file
+ * @param len - Size of the mapping
+ * @param states - Table whose filter decides which blocks match
+ * @param num_ranges - Receives the number of ranges
+ * @return The ranges in file order, to free, or NULL if the file has to be read whole
+ */
+static struct byte_range *index_ranges(const char *path, int fd, const char *map, size_t len,
+                                       struct state_table *states, int *num_ranges) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NULL;
+    const size_t path_len = strlen(path);
+    char *index_path = malloc(path_len + sizeof(INDEX_SUFFIX));
+    if (index_path == NULL) return NULL;
+    memcpy(index_path, path, path_len);
+    memcpy(index_path + path_len, INDEX_SUFFIX, sizeof(INDEX_SUFFIX));
+
+    //Use the saved index when it's still current, build it otherwise
+    size_t num_blocks = 0, index_len = 0;
+    const struct index_block *blocks = NULL;
+    struct index_block *built = NULL;
+    const char *index_map = NULL;
+    const int index_fd = open(index_path, O_RDONLY);
+    if (index_fd >= 0) {
+        index_map = map_file(index_fd, &index_len);
+        close(index_fd);
+        if (index_map != NULL) blocks = check_index(index_map, index_len, &st, &num_blocks);
+    }
+    if (blocks == NULL) {
+        built = build_index(map, len, &num_blocks);
+        if (built != NULL) save_index(index_path, &st, built, num_blocks);
+        blocks = built;
+    }
+    free(index_path);
+
+    struct byte_range *ranges = blocks != NULL ? malloc((num_blocks + 1) * sizeof(*ranges)) : NULL;
+    if (ranges != NULL) {
+        *num_ranges = 0;
+        posix_madvise((void *) map, len, POSIX_MADV_RANDOM);
+        const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t skipped = 0;
+        for (size_t b = 0; b < num_blocks; b++) {
+            if (!zone_matches(&blocks[b], states->filter)) {
+                skipped += blocks[b].len;
+                continue;
+            }
+            struct byte_range *last = *num_ranges > 0 ? &ranges[*num_ranges - 1] : NULL;
+            if (last != NULL && last->start + last->len == blocks[b].offset) {
+                last->len += blocks[b].len;
+            } else {
+                ranges[(*num_ranges)++] = (struct byte_range) {blocks[b].offset, blocks[b].len};
+            }
+        }
+        //madvise wants a page aligned start
+        for (int r = 0; r < *num_ranges; r++) {
+            const size_t start = ranges[r].start / page * page;
+            posix_madvise((void *) (map + start), ranges[r].start + ranges[r].len - start, POSIX_MADV_WILLNEED);
+        }
+        COUNTER_ADD(states, bytes_skipped, skipped);
+    }
+    if (index_map != NULL) munmap((void *) index_map, index_len);
+    free(built);
+    return ranges;
+}
+
+int analyze_mapped(int fd, const char *path, struct state_table *states, int num_threads) {
+    size_t len;
+    COUNTER_START(mapping);
+    const char *map = map_file(fd, &len);
+    COUNTER_STOP(states, io_ns, mapping);
+    if (map == NULL) return 0;
+
+    int num_ranges = 0;
+    struct byte_range *ranges = NULL;
+    if (states->indexed && path != NULL
+        && !(len >= sizeof(COLUMN_MAGIC) - 1 && memcmp(map, COLUMN_MAGIC, sizeof(COLUMN_MAGIC) - 1) == 0)) {
+        ranges = index_ranges(path, fd, map, len, states, &num_ranges);
+    }
+    int status = 0;
+    if (ranges != NULL) {
+        for (int r = 0; r < num_ranges; r++) {
+            if (num_threads > 1) {
+                analyze_parallel(map + ranges[r].start, ranges[r].len, states, num_threads);
+            } else analyze_buffer(map + ranges[r].start, ranges[r].len, states);
+        }
+        free(ranges);
+    } else status = analyze_mapping(map, len, states, num_threads);
+    COUNTER_START(unmapping);
+    munmap((void *) map, len);
+    COUNTER_STOP(states, io_ns, unmapping);
+    return status == 0 ? 1 : -1;
+}
+
+/**
+ * Finds every tab and newline in a 64 byte block at once, using AVX2, SSE2 or NEON when the compiler targets them
+ * and a plain loop otherwise.
+ * @param p - Start of the block, all 64 bytes must be readable
+ * @param tabs - Receives a mask with bit i set when p[i] is a tab
+ * @param newlines - Receives a mask with bit i set when p[i] is a newline
+ */
+static void scan_block(const char *p, uint64_t *tabs, uint64_t *newlines) {
+#if defined(__AVX2__)
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i lo = _mm256_loadu_si256((const __m256i *) p);
+    const __m256i hi = _mm256_loadu_si256((const __m256i *) (p + 32));
+    *tabs = (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, tab))
+            | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, tab)) << 32;
+    *newlines = (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl))
+                | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)) << 32;
+#elif defined(__SSE2__)
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t t = 0, n = 0;
+    for (int i = 0; i < 4; i++) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+        t |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)) << (16 * i);
+        n |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * i);
+    }
+    *tabs = t;
+    *newlines = n;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    //NEON has no movemask, so weight each matching lane by its bit and add neighbouring lanes together
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x16_t bit = vld1q_u8(weights);
+    uint8x16_t t[4], n[4];
+    for (int i = 0; i < 4; i++) {
+        const uint8x16_t v = vld1q_u8((const uint8_t *) p + 16 * i);
+        t[i] = vandq_u8(vceqq_u8(v, vdupq_n_u8('\t')), bit);
+        n[i] = vandq_u8(vceqq_u8(v, vdupq_n_u8('\n')), bit);
+    }
+    uint8x16_t ts = vpaddq_u8(vpaddq_u8(t[0], t[1]), vpaddq_u8(t[2], t[3]));
+    uint8x16_t ns = vpaddq_u8(vpaddq_u8(n[0], n[1]), vpaddq_u8(n[2], n[3]));
+    *tabs = vgetq_lane_u64(vreinterpretq_u64_u8(vpaddq_u8(ts, ts)), 0);
+    *newlines = vgetq_lane_u64(vreinterpretq_u64_u8(vpaddq_u8(ns, ns)), 0);
+#else
+    uint64_t t = 0, n = 0;
+    for (int i = 0; i < 64; i++) {
+        t |= (uint64_t) (p[i] == '\t') << i;
+        n |= (uint64_t) (p[i] == '\n') << i;
+    }
+    *tabs = t;
+    *newlines = n;
+#endif
+}
+
+/**
+ * Finishes a record split by analyze_buffer. A carriage return before the newline is dropped from the last field so
+ * CRLF files parse the same as LF ones, and blank lines are ignored. The record is decoded into the batch, which is
+ * flushed once it is full, or counted as malformed.
+ * @param fields - Fields of the record
+ * @param num_fields - Number of fields the record had
+ * @param states - Table containing climate info structs for every state seen so far
+ * @param batch - Batch of decoded records of the buffer being analyzed
+ */
+static void end_record(struct field fields[], int num_fields, struct state_table *states,
+                       struct record_batch *batch) {
+    if (num_fields == 0) return;
+    if (num_fields <= NUM_FIELDS) {
+        struct field *last = &fields[num_fields - 1];
+        if (last->ptr[last->len - 1] == '\r') {
+            //A field that was only a carriage return doesn't count
+            if (--last->len == 0 && --num_fields == 0) return;
+        }
+    }
+    if (states->decode(fields, num_fields, states->skip_fields, states->geohash, &batch->recs[batch->count])) {
+        if (++batch->count == BATCH_SZ) flush_batch(states, batch);
+    } else states->malformed++;
+}
+
+/**
+ * Checks one of the leading fields of a record against a filter.
+ * @param filter - The filter
+ * @param f - The field
+ * @param index - FIELD_STATE or FIELD_TIMESTAMP
+ * @return 0 if the filter rejects the record, 1 if it may keep it. Fields that don't parse are kept, they are
+ * counted as malformed later.
+ */
+static int filter_keeps(const struct record_filter *filter, const struct field *f, int index) {
+    if (index == FIELD_STATE) {
+        const int key = state_key(f->ptr, f->len);
+        return !filter->by_state || key < 0 || filter->keep[key];
+    }
+    long timestamp;
+    if (!parse_long(f->ptr, f->len, &timestamp)) return 1;
+    const long seconds = timestamp / 1000;
+    return seconds >= filter->from && seconds < filter->to;
+}
+
+/**
+ * @return The delimiters of a block without the tabs before its first newline, all of them if it has none
+ */
+static uint64_t skip_to_newline(uint64_t delims, uint64_t newlines) {
+    const uint64_t nl = delims & newlines;
+    return nl == 0 ? 0 : delims & ~((nl & (0 - nl)) - 1);
+}
+
+void analyze_buffer(const char *buf, size_t len, struct state_table *states) {
+    COUNTER_START(parsing);
+    COUNTER_ADD(states, bytes_read, len);
+    struct record_batch batch;
+    batch.count = 0;
+    struct field fields[NUM_FIELDS];
+    //Fields seen in the current record, this keeps counting past NUM_FIELDS so extra fields can be detected
+    int num_fields = 0;
+    //Start of the record and of the field we are currently in
+    const char *record = buf;
+    const char *field = buf;
+    const struct record_filter *filter = states->filter;
+    //Set while the rest of a record the filter rejected is skipped up to its newline
+    int rejected = 0;
+
+    for (size_t base = 0; base < len; base += 64) {
+        uint64_t tabs, newlines;
+        if (len - base >= 64) {
+            scan_block(buf + base, &tabs, &newlines);
+        } else {
+            //Pad the last partial block with zeros, they never match a delimiter
+            char block[64] = {0};
+            memcpy(block, buf + base, len - base);
+            scan_block(block, &tabs, &newlines);
+        }
+
+        //Walk the delimiters of this block in order, lowest bit first
+        uint64_t delims = tabs | newlines;
+        if (rejected) delims = skip_to_newline(delims, newlines);
+        while (delims != 0) {
+            const int bit = __builtin_ctzll(delims);
+            delims &= delims - 1;
+            const char *delim = buf + base + bit;
+
+            if (rejected) {
+                //Only the newline of a rejected record is left
+                COUNTER_ADD(states, filtered, 1);
+                rejected = 0;
+                num_fields = 0;
+                field = record = delim + 1;
+                continue;
+            }
+
+            //Empty fields are skipped, the same as strtok treats repeated tabs
+            if (delim > field) {
+                if (num_fields < NUM_FIELDS) {
+                    fields[num_fields].ptr = field;
+                    fields[num_fields].len = (size_t) (delim - field);
+                }
+                num_fields++;
+                //The state and timestamp are checked as soon as they are split, the other fields never are if
+                //the filter rejects the record
+                if (filter != NULL && num_fields <= FIELD_TIMESTAMP + 1 && !(newlines >> bit & 1)
+                    && !filter_keeps(filter, &fields[num_fields - 1], num_fields - 1)) {
+                    rejected = 1;
+                    delims = skip_to_newline(delims, newlines);
+                }
+            }
+            field = delim + 1;
+
+            if (newlines >> bit & 1) {
+                end_record(fields, num_fields, states, &batch);
+                num_fields = 0;
+                record = field;
+            }
+        }
+    }
+
+    //The last record may not have a newline
+    const char *end = buf + len;
+    if (rejected) {
+        COUNTER_ADD(states, filtered, 1);
+    } else if (record < end) {
+        if (end > field) {
+            if (num_fields < NUM_FIELDS) {
+                fields[num_fields].ptr = field;
+                fields[num_fields].len = (size_t) (end - field);
+            }
+            num_fields++;
+        }
+        end_record(fields, num_fields, states, &batch);
+    }
+    flush_batch(states, &batch);
+    COUNTER_STOP(states, ingest_ns, parsing);
+}
+
+/**
+ * Work handed to one parsing thread
+ */
+struct parse_chunk {
+    const char *buf; //First byte of the chunk, always the start of a record
+    size_t len; //Length of the chunk, always ends after a newline or at the end of the file
+    struct state_table states; //Private summaries for this chunk only
+};
+
+static void *parse_chunk_worker(void *arg) {
+    struct parse_chunk *chunk = arg;
+    analyze_buffer(chunk->buf, chunk->len, &chunk->states);
+    return NULL;
+}
+
+void analyze_parallel(const char *buf, size_t len, struct state_table *states, int num_threads) {
+    struct parse_chunk *chunks = calloc((size_t) num_threads, sizeof(struct parse_chunk));
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS] = {0};
+    if (chunks == NULL) {
+        analyze_buffer(buf, len, states);
+        return;
+    }
+
+    //Cut the buffer into roughly equal pieces, moving each cut forward to just past the next newline
+    const char *end = buf + len;
+    const char *p = buf;
+    for (int t = 0; t < num_threads; t++) {
+        const char *cut = t == num_threads - 1 ? end : buf + len / (size_t) num_threads * (size_t) (t + 1);
+        if (cut < p) cut = p;
+        if (cut < end) {
+            const char *nl = memchr(cut, '\n', (size_t) (end - cut));
+            cut = nl != NULL ? nl + 1 : end;
+        }
+        chunks[t].states.bucket = states->bucket;
+        chunks[t].states.geohash = states->geohash;
+        chunks[t].states.skip_fields = states->skip_fields;
+        chunks[t].states.decode = states->decode;
+        chunks[t].states.filter = states->filter;
+        chunks[t].states.timed = states->timed;
+        chunks[t].buf = p;
+        chunks[t].len = (size_t) (cut - p);
+        p = cut;
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        if (chunks[t].len == 0) continue;
+        //If a thread can't be created its chunk is parsed on this one instead
+        started[t] = pthread_create(&threads[t], NULL, parse_chunk_worker, &chunks[t]) == 0;
+        if (!started[t]) parse_chunk_worker(&chunks[t]);
+    }
+    //Merging in chunk order keeps the first-seen order of states and the dates of tied extremes
+    for (int t = 0; t < num_threads; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+        merge_states(states, &chunks[t].states);
+        free_states(&chunks[t].states);
+    }
+    free(chunks);
+}
+
+/**
+ * Folds one summary into another.
+ * @param dst - Summary merged into
+ * @param src - Summary merged from, unchanged
+ */
+static void merge_info(struct climate_info *dst, const struct climate_info *src) {
+    stat_merge(&dst->temp, dst->num_records, &src->temp, src->num_records);
+    stat_merge(&dst->humidity, dst->num_records, &src->humidity, src->num_records);
+    stat_merge(&dst->cloudCover, dst->num_records, &src->cloudCover, src->num_records);
+    dst->num_records += src->num_records;
+    dst->lightningStrikeCount += src->lightningStrikeCount;
+    dst->snowCoverCount += src->snowCoverCount;
+    if (src->maxTemp > dst->maxTemp) {
+        dst->maxTemp = src->maxTemp;
+        dst->maxTempTS = src->maxTempTS;
+    }
+    if (src->minTemp < dst->minTemp) {
+        dst->minTemp = src->minTemp;
+        dst->minTempTS = src->minTempTS;
+    }
+}
+
+/**
+ * Folds the time buckets of a state into those of the same state in another table, and leaves src empty.
+ * @param dst - Buckets merged into
+ * @param arena - Arena of the table dst belongs to
+ * @param src - Buckets merged from
+ * @return Number of records of src that didn't fit in dst, see bucket_cell
+ */
+static unsigned long long merge_buckets(struct bucket_array *dst, struct arena *arena, struct bucket_array *src) {
+    unsigned long long dropped = 0;
+    //Buckets of a state we haven't bucketed yet are copied over as they are
+    if (dst->count == 0 && src->count > 0) {
+        dst->cells = arena_alloc(arena, (size_t) src->count * sizeof(*dst->cells));
+        if (dst->cells != NULL) {
+            memcpy(dst->cells, src->cells, (size_t) src->count * sizeof(*dst->cells));
+            dst->first = src->first;
+            dst->count = src->count;
+        } else {
+            for (int b = 0; b < src->count; b++) dropped += src->cells[b].num_records;
+        }
+    } else {
+        for (int b = 0; b < src->count; b++) {
+            if (src->cells[b].num_records == 0) continue;
+            struct climate_info *cell = bucket_cell(dst, arena, src->first + b);
+            if (cell != NULL) {
+                merge_info(cell, &src->cells[b]);
+            } else dropped += src->cells[b].num_records;
+        }
+    }
+    src->cells = NULL;
+    src->first = 0;
+    src->count = 0;
+    return dropped;
+}
+
+/**
+ * Folds one state of partial into states.
+ * @param states - Table the state is merged into, the state is added to the end if it is new there
+ * @param partial - Table the state is merged from
+ * @param i - Number of the state in partial
+ */
+static void merge_state(struct state_table *states, struct state_table *partial, int i) {
+    struct climate_info src;
+    state_summary(partial, i, &src);
+    const int key = state_key(src.code, 2);
+    partial->slot[key] = 0;
+    const int dst = stateFromKey(states, key);
+    add_summary(states, dst, &src);
+    sketch_merge(states->totals.tempBins[dst], partial->totals.tempBins[i]);
+    states->unbucketed += merge_buckets(&states->buckets[dst], &states->arena, &partial->buckets[i]);
+}
+
+void merge_states(struct state_table *states, struct state_table *partial) {
+    for (int i = 0; i < partial->num_states; i++) merge_state(states, partial, i);
+    partial->num_states = 0;
+    for (size_t i = 0; i < partial->cells.num_cells; i++) {
+        struct climate_info *cell = cell_find(&states->cells, &states->arena, partial->cells.cells[i].key);
+        if (cell != NULL) {
+            merge_info(cell, &partial->cells.cells[i].info);
+        } else states->ungrouped += partial->cells.cells[i].info.num_records;
+    }
+    memset(&partial->cells, 0, sizeof(partial->cells));
+    states->aggregate_time += partial->aggregate_time;
+    partial->aggregate_time = 0;
+    states->malformed += partial->malformed;
+    partial->malformed = 0;
+    states->unbucketed += partial->unbucketed;
+    partial->unbucketed = 0;
+    states->ungrouped += partial->ungrouped;
+    partial->ungrouped = 0;
+#ifdef CLIMATE_COUNTERS
+    const struct counters *c = &partial->counters;
+    states->counters.bytes_read += c->bytes_read;
+    states->counters.records += c->records;
+    states->counters.filtered += c->filtered;
+    states->counters.bytes_skipped += c->bytes_skipped;
+    states->counters.new_states += c->new_states;
+    states->counters.max_updates += c->max_updates;
+    states->counters.min_updates += c->min_updates;
+    states->counters.io_ns += c->io_ns;
+    states->counters.ingest_ns += c->ingest_ns;
+    states->counters.aggregate_ns += c->aggregate_ns;
+    memset(&partial->counters, 0, sizeof(partial->counters));
+#endif
+}
+
+int analyze_path(const char *path, struct state_table *states, int num_threads, struct checkpoint *cp) {
+    const int is_stdin = strcmp(path, "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY); //Open the file for reading
+    if (fd < 0) return FILE_MISSING;
+
+    int status;
+    if (cp != NULL) {
+        //Only what was appended since the last run is parsed
+        status = analyze_appended(fd, path, cp, states, num_threads) != 0 ? FILE_FAILED : FILE_OK;
+    } else {
+        //Regular files are mapped and parsed in place, anything else (pipes, devices) is streamed with read().
+        //stdin redirected from a file can be mapped too, as long as nothing has been read from it yet.
+        int mapped = 0;
+        if (!is_stdin || lseek(fd, 0, SEEK_CUR) == 0) mapped = analyze_mapped(fd, is_stdin ? NULL : path, states,
+                                                                               num_threads);
+        if (mapped == 0 && analyze_file(fd, states) != 0) mapped = -1;
+        status = mapped < 0 ? FILE_FAILED : FILE_OK;
+    }
+    if (!is_stdin) close(fd);
+    return status;
+}
+
+/**
+ * One unit of work for analyze_files_parallel: a byte range of a mapped file, a whole columnar cache file, or a
+ * whole stream that can't be mapped
+ */
+struct ingest_task {
+    const char *buf; //Start of the range, NULL to stream fd with analyze_file instead
+    size_t len; //Length of the range
+    int columnar; //Set when buf is a whole columnar cache file
+    int fd; //Descriptor to stream when buf is NULL
+    struct state_table *states; //Summaries of the segment this task starts, NULL if joined or out of memory
+    int joined; //Set when the task was added to the table of the task before it, see pool_worker_main
+    int status; //FILE_PENDING until the task is done, then FILE_OK or FILE_FAILED
+};
+
+/**
+ * Tasks of one input file of analyze_files_parallel
+ */
+struct ingest_file {
+    int fd; //Open descriptor, -1 if the file couldn't be opened
+    const char *map; //Mapping of the file, NULL if it isn't mapped
+    size_t len; //Size of the mapping
+    int first_task; //Index of the first task of the file
+    int num_tasks;
+};
+
+/**
+ * Tasks still waiting in one worker's share, tasks[head] to tasks[tail - 1]. The owner takes from the head, which
+ * keeps it walking forward through the same file, and thieves take from the tail.
+ */
+struct task_deque {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+};
+
+struct task_pool {
+    struct ingest_task *tasks;
+    struct task_deque deques[MAX_THREADS];
+    int num_workers;
+    enum bucket_size bucket; //Copied into the table of every task
+    int geohash;
+    unsigned skip_fields;
+    decoder_fn *decode;
+    const struct record_filter *filter;
+    pthread_mutex_t lock; //Guards the status of every task
+    pthread_cond_t done; //Signalled whenever a task is done
+};
+
+/**
+ * Argument of one pool worker thread
+ */
+struct pool_worker {
+    struct task_pool *pool;
+    int id; //Index of the worker's own deque
+};
+
+/**
+ * Takes the next task for a worker, from its own deque first and then from the others.
+ * @return Index of the task, or -1 once every deque is empty
+ */
+static int take_task(struct task_pool *pool, int id) {
+    for (int n = 0; n < pool->num_workers; n++) {
+        const int victim = (id + n) % pool->num_workers;
+        struct task_deque *deque = &pool->deques[victim];
+        int task = -1;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->head < deque->tail) task = victim == id ? deque->head++ : --deque->tail;
+        pthread_mutex_unlock(&deque->lock);
+        if (task >= 0) return task;
+    }
+    return -1;
+}
+
+/* Tasks a worker takes one after another, which is its whole share until it starts stealing, are added to one
+ * table, a segment. Merging the segments in the order of their first tasks then gives the same summaries as
+ * merging task by task, while only a table per worker and per steal is alive at once. */
+static void *pool_worker_main(void *arg) {
+    struct pool_worker *worker = arg;
+    struct task_pool *pool = worker->pool;
+    struct state_table *segment = NULL;
+    int last = -1;
+    int t;
+    while ((t = take_task(pool, worker->id)) >= 0) {
+        struct ingest_task *task = &pool->tasks[t];
+        int status = FILE_FAILED;
+        task->joined = segment != NULL && t == last + 1;
+        if (!task->joined) {
+            //The main thread owns the previous segment through its first task and frees it after merging
+            segment = calloc(1, sizeof(struct state_table));
+            task->states = segment;
+            if (segment != NULL) {
+                segment->bucket = pool->bucket;
+                segment->geohash = pool->geohash;
+                segment->skip_fields = pool->skip_fields;
+                segment->decode = pool->decode;
+                segment->filter = pool->filter;
+            }
+        }
+        last = t;
+        if (segment != NULL) {
+            if (task->buf == NULL) {
+                status = analyze_file(task->fd, segment) != 0 ? FILE_FAILED : FILE_OK;
+            } else if (task->columnar) {
+                status = analyze_columnar(task->buf, task->len, segment) != 0 ? FILE_FAILED : FILE_OK;
+            } else {
+                analyze_buffer(task->buf, task->len, segment);
+                status = FILE_OK;
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        task->status = status;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Opens one input file and adds its tasks, growing the task array as needed.
+ * @return 0 on success, -1 if out of memory
+ */
+static int plan_file(const char *path, struct state_table *states, struct ingest_file *file,
+                     struct ingest_task **tasks, int *num_tasks, int *capacity) {
+    const int is_stdin = strcmp(path, "-") == 0;
+    file->fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+    file->map = NULL;
+    file->len = 0;
+    file->first_task = *num_tasks;
+    file->num_tasks = 0;
+    if (file->fd < 0) return 0;
+    //stdin redirected from a file can be mapped too, as long as nothing has been read from it yet
+    if (!is_stdin || lseek(file->fd, 0, SEEK_CUR) == 0) file->map = map_file(file->fd, &file->len);
+
+    const int columnar = file->map != NULL && file->len >= sizeof(COLUMN_MAGIC) - 1
+                         && memcmp(file->map, COLUMN_MAGIC, sizeof(COLUMN_MAGIC) - 1) == 0;
+    //With --index only the ranges its blocks allow are planned, otherwise the whole file is one range
+    int num_ranges = 1;
+    struct byte_range *ranges = NULL;
+    if (file->map != NULL && !columnar && states->indexed && !is_stdin) {
+        ranges = index_ranges(path, file->fd, file->map, file->len, states, &num_ranges);
+        if (ranges == NULL) num_ranges = 1;
+    }
+    int status = 0;
+    for (int r = 0; r < num_ranges && status == 0; r++) {
+        const char *p = file->map + (ranges != NULL ? ranges[r].start : 0);
+        const char *end = p + (ranges != NULL ? ranges[r].len : file->len);
+        do {
+            if (*num_tasks == *capacity) {
+                const int grown = *capacity > 0 ? *capacity * 2 : 64;
+                struct ingest_task *bigger = realloc(*tasks, (size_t) grown * sizeof(**tasks));
+                if (bigger == NULL) {
+                    status = -1;
+                    break;
+                }
+                *tasks = bigger;
+                *capacity = grown;
+            }
+            struct ingest_task *task = &(*tasks)[(*num_tasks)++];
+            file->num_tasks++;
+            task->buf = p;
+            task->columnar = columnar;
+            task->fd = file->fd;
+            task->states = NULL;
+            task->joined = 0;
+            task->status = FILE_PENDING;
+            if (p == NULL || columnar) {
+                task->len = file->len;
+                break;
+            }
+            //Cut after the first newline past TASK_SZ, so every range is whole records
+            const size_t left = (size_t) (end - p);
+            const char *cut = left > TASK_SZ ? memchr(p + TASK_SZ, '\n', left - TASK_SZ) : NULL;
+            cut = cut != NULL ? cut + 1 : end;
+            task->len = (size_t) (cut - p);
+            p = cut;
+        } while (p < end);
+    }
+    free(ranges);
+    return status;
+}
+
+void analyze_files_parallel(char *files[], int num_files, struct state_table *states, int num_workers,
+                            FILE *progress) {
+    static struct task_pool pool;
+    struct ingest_file *plan = malloc((size_t) num_files * sizeof(*plan));
+    struct ingest_task *tasks = NULL;
+    int num_tasks = 0, capacity = 0;
+    if (plan == NULL) return;
+    int planned = 0;
+    COUNTER_START(planning);
+    while (planned < num_files
+           && plan_file(files[planned], states, &plan[planned], &tasks, &num_tasks, &capacity) == 0) {
+        planned++;
+    }
+    COUNTER_STOP(states, io_ns, planning);
+    //Files that couldn't be planned for lack of memory are reported as unreadable
+    for (int i = planned; i < num_files; i++) plan[i].num_tasks = 0;
+
+    pool.tasks = tasks;
+    pool.num_workers = num_workers < num_tasks ? num_workers : (num_tasks > 0 ? num_tasks : 1);
+    pool.bucket = states->bucket;
+    pool.geohash = states->geohash;
+    pool.skip_fields = states->skip_fields;
+    pool.decode = states->decode;
+    pool.filter = states->filter;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    for (int w = 0; w < pool.num_workers; w++) {
+        pthread_mutex_init(&pool.deques[w].lock, NULL);
+        pool.deques[w].head = (int) ((long) num_tasks * w / pool.num_workers);
+        pool.deques[w].tail = (int) ((long) num_tasks * (w + 1) / pool.num_workers);
+    }
+
+    pthread_t threads[MAX_THREADS];
+    struct pool_worker workers[MAX_THREADS];
+    int started = 0;
+    for (; started < pool.num_workers; started++) {
+        workers[started].pool = &pool;
+        workers[started].id = started;
+        if (pthread_create(&threads[started], NULL, pool_worker_main, &workers[started]) != 0) break;
+    }
+    //Without any threads the main thread does all the work, the other workers' shares get stolen otherwise
+    if (started == 0) {
+        workers[0].pool = &pool;
+        workers[0].id = 0;
+        pool_worker_main(&workers[0]);
+    }
+
+    /* Merge segment by segment in file order, reporting each file once its first task is done. A segment is
+     * complete once the task after its last one is done, as that one starts the next segment */
+    struct state_table *segment = NULL;
+    for (int i = 0; i < num_files; i++) {
+        const struct ingest_file *file = &plan[i];
+        int status = i < planned ? (file->fd < 0 ? FILE_MISSING : FILE_OK) : FILE_FAILED;
+        for (int t = file->first_task; t < file->first_task + file->num_tasks; t++) {
+            pthread_mutex_lock(&pool.lock);
+            while (tasks[t].status == FILE_PENDING) pthread_cond_wait(&pool.done, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+            if (t == file->first_task) fprintf(progress, "Opening file: %s\n", files[i]);
+            if (tasks[t].status != FILE_OK) status = FILE_FAILED;
+            if (!tasks[t].joined) {
+                if (segment != NULL) {
+                    merge_states(states, segment);
+                    free_states(segment);
+                    free(segment);
+                }
+                segment = tasks[t].states;
+            }
+        }
+        if (file->num_tasks == 0) fprintf(progress, "Opening file: %s\n", files[i]);
+        if (status == FILE_MISSING) fprintf(progress, "Error File # %d doesn't exist!\n", i + 1);
+        if (status == FILE_FAILED) fprintf(progress, "Error reading file # %d\n", i + 1);
+    }
+    if (segment != NULL) {
+        merge_states(states, segment);
+        free_states(segment);
+        free(segment);
+    }
+
+    for (int w = 0; w < started; w++) pthread_join(threads[w], NULL);
+    for (int w = 0; w < pool.num_workers; w++) pthread_mutex_destroy(&pool.deques[w].lock);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.done);
+    for (int i = 0; i < planned; i++) {
+        if (plan[i].map != NULL) munmap((void *) plan[i].map, plan[i].len);
+        if (plan[i].fd >= 0 && plan[i].fd != STDIN_FILENO) close(plan[i].fd);
+    }
+    free(tasks);
+    free(plan);
+}
+
+//Powers of ten that are exact in a double, 10^22 is the largest one
+static const double exact_pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**
+ * Parses a decimal field with libc, for the forms parse_decimal doesn't handle itself. The field is copied so strtod
+ * can never read past it.
+ * @param field - First byte of the field
+ * @param len - Length of the field
+ * @param value - Receives the value of the field
+ * @return 1 if the whole field is a number, 0 if not
+ */
+static int parse_decimal_slow(const char *field, size_t len, double *value) {
+    char number[NUMBER_SZ];
+    char *end;
+    if (len == 0 || len >= sizeof(number)) return 0;
+    memcpy(number, field, len);
+    number[len] = '\0';
+    *value = strtod(number, &end);
+    return end == number + len;
+}
+
+/**
+ * Parses a plain decimal field like 285.07513 in one pass. When the digits fit in 53 bits and there are no more
+ * than 22 of them after the point, both the digits and the power of ten are exact doubles, so a single division
+ * gives the correctly rounded result, the same value strtod returns. Anything else (exponents, very long numbers)
+ * goes to parse_decimal_slow.
+ * @param field - First byte of the field
+ * @param len - Length of the field
+ * @param value - Receives the value of the field
+ * @return 1 if the whole field is a number, 0 if not
+ */
+static int parse_decimal(const char *field, size_t len, double *value) {
+    const char *p = field;
+    const char *end = field + len;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    unsigned long long digits = 0;
+    int num_digits = 0;
+    int frac_digits = -1; //-1 until we pass the decimal point
+    for (; p < end; p++) {
+        const unsigned d = (unsigned char) *p - '0';
+        if (d < 10) {
+            //Leading zeros don't count towards the 53 bit limit
+            if (digits >= (1ULL << 53) / 10) return parse_decimal_slow(field, len, value);
+            digits = digits * 10 + d;
+            num_digits++;
+            if (frac_digits >= 0) frac_digits++;
+        } else if (*p == '.' && frac_digits < 0) {
+            frac_digits = 0;
+        } else return parse_decimal_slow(field, len, value);
+    }
+    if (num_digits == 0 || frac_digits > 22) return parse_decimal_slow(field, len, value);
+
+    double result = (double) digits;
+    if (frac_digits > 0) result /= exact_pow10[frac_digits];
+    *value = negative ? -result : result;
+    return 1;
+}
+
+/**
+ * Parses a field of plain decimal digits such as a timestamp.
+ * @param field - First byte of the field
+ * @param len - Length of the field
+ * @param value - Receives the value of the field
+ * @return 1 if the field is a non-negative integer that fits, 0 if not
+ */
+static int parse_long(const char *field, size_t len, long *value) {
+    //18 digits can't overflow a 64 bit long
+    if (len == 0 || len > 18) return 0;
+    long result = 0;
+    for (size_t i = 0; i < len; i++) {
+        const unsigned d = (unsigned char) field[i] - '0';
+        if (d >= 10) return 0;
+        result = result * 10 + (long) d;
+    }
+    *value = result;
+    return 1;
+}
+
+/**
+ * Packs a geohash prefix into an integer: 5 bits per character, followed by 4 bits of prefix length so that no
+ * key is 0. Keys of the same length sort in the same order as the geohash strings.
+ * @param ptr - Start of the geohash
+ * @param len - Length of the geohash
+ * @param precision - Number of characters to keep, 1 - MAX_GEOHASH
+ * @return The key, or 0 if the geohash is shorter than precision or has a character geohashes don't use
+ */
+static uint64_t geohash_key(const char *ptr, size_t len, int precision) {
+    //Values of 'a' - 'z' in the geohash base 32 alphabet, which leaves out a, i, l and o
+    static const signed char letters[26] = {-1, 10, 11, 12, 13, 14, 15, 16, -1, 17, 18, -1, 19, 20, -1, 21, 22, 23,
+                                            24, 25, 26, 27, 28, 29, 30, 31};
+    if (len < (size_t) precision) return 0;
+    uint64_t key = 0;
+    for (int i = 0; i < precision; i++) {
+        const unsigned char c = (unsigned char) ptr[i];
+        int value = -1;
+        if (c >= '0' && c <= '9') {
+            value = c - '0';
+        } else if (c >= 'a' && c <= 'z') {
+            value = letters[c - 'a'];
+        }
+        if (value < 0) return 0;
+        key = key << 5 | (uint64_t) value;
+    }
+    return key << 4 | (uint64_t) precision;
+}
+
+/**
+ * Works out which fields a run doesn't need to decode.
+ * @param metrics - METRIC_* bits that are reported
+ * @param bucket - Time bucket size, the bucket tables need the timestamp and every metric
+ * @param geohash - Geohash precision, the cell table needs the geohash and every metric
+ * @return Bit per field_index that decode_fields can skip
+ */
+static unsigned projection_skip(unsigned metrics, enum bucket_size bucket, int geohash) {
+    unsigned features = metrics;
+    if (bucket != BUCKET_NONE) features |= METRIC_ALL | NEED_BUCKET;
+    if (geohash > 0) features |= METRIC_ALL | NEED_CELL;
+    return FIELD_SKIP(features);
+}
+
+//How each kind of field in RECORD_FIELDS is decoded into out, evaluating to 0 when it's malformed
+#define DECODE_KEY(f, out) (((out) = state_key((f).ptr, (f).len)) >= 0)
+#define DECODE_LONG(f, out) parse_long((f).ptr, (f).len, &(out))
+#define DECODE_CELL(f, out) ((out) = geohash_key((f).ptr, (f).len, geohash), 1)
+#define DECODE_DECIMAL(f, out) parse_decimal((f).ptr, (f).len, &(out))
+#define DECODE_FLAG(f, out) ((out) = *(f).ptr == '1', 1)
+#define DECODE_NONE(f, out) 1
+//What out is left as when the field is skipped
+#define CLEAR_KEY(out) ((out) = -1)
+#define CLEAR_LONG(out) ((out) = 0)
+#define CLEAR_CELL(out) ((out) = 0)
+#define CLEAR_DECIMAL(out) ((out) = 0)
+#define CLEAR_FLAG(out) ((out) = 0)
+#define CLEAR_NONE(out) ((void) 0)
+#define DECODE_FIELD(name, kind, member, need, arg) \
+    if (skip & 1u << FIELD_##name) { \
+        CLEAR_##kind(rec->member); \
+    } else if (!DECODE_##kind(fields[FIELD_##name], rec->member)) return 0;
+//Body of a decoder, skip is a constant in the specialized ones so the tests of skipped fields are compiled out
+#define DECODE_RECORD \
+    if (num_fields != NUM_FIELDS) return 0; \
+    RECORD_FIELDS(DECODE_FIELD, 0) \
+    return 1;
+
+int decode_fields(const struct field fields[], int num_fields, unsigned skip, int geohash, struct record *rec) {
+    DECODE_RECORD
+}
+
+/* Runs get a decoder of their own for every --metrics choice, which covers converting and checkpoints too, and
+ * for every metric with the geohash cells. --bucket only adds the timestamp, which the temperature already needs. */
+#define SPECIALIZED_DECODERS(X) \
+    X(m0, 0) X(m1, 1) X(m2, 2) X(m3, 3) X(m4, 4) X(m5, 5) X(m6, 6) X(m7, 7) \
+    X(m8, 8) X(m9, 9) X(m10, 10) X(m11, 11) X(m12, 12) X(m13, 13) X(m14, 14) X(m15, 15) \
+    X(m16, 16) X(m17, 17) X(m18, 18) X(m19, 19) X(m20, 20) X(m21, 21) X(m22, 22) X(m23, 23) \
+    X(m24, 24) X(m25, 25) X(m26, 26) X(m27, 27) X(m28, 28) X(m29, 29) X(m30, 30) X(m31, 31) \
+    X(cells, METRIC_ALL | NEED_CELL)
+#define DEFINE_DECODER(name, features) \
+    static int decode_##name(const struct field fields[], int num_fields, unsigned runtime_skip, int geohash, \
+                             struct record *rec) { \
+        const unsigned skip = FIELD_SKIP(features); \
+        (void) runtime_skip; \
+        DECODE_RECORD \
+    }
+SPECIALIZED_DECODERS(DEFINE_DECODER)
+
+decoder_fn *select_decoder(unsigned skip) {
+#define DECODER_ENTRY(name, features) {FIELD_SKIP(features), decode_##name},
+    static const struct {
+        unsigned skip;
+        decoder_fn *decode;
+    } decoders[] = {SPECIALIZED_DECODERS(DECODER_ENTRY)};
+#undef DECODER_ENTRY
+    for (size_t i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+        if (decoders[i].skip == skip) return decoders[i].decode;
+    }
+    return decode_fields;
+}
+
+void flush_batch(struct state_table *states, struct record_batch *batch) {
+    COUNTER_START(flushing);
+    COUNTER_ADD(states, records, batch->count);
+    if (states->convert != NULL) {
+        for (int i = 0; i < batch->count; i++) column_writer_append(states->convert, &batch->recs[i]);
+    } else if (states->timed) {
+        const double start = bench_now();
+        aggregate_batch(states, batch->recs, batch->count);
+        states->aggregate_time += bench_now() - start;
+    } else aggregate_batch(states, batch->recs, batch->count);
+    batch->count = 0;
+    COUNTER_STOP(states, aggregate_ns, flushing);
+}
+
+/**
+ * Merges the batch sums of one metric into its running stat and starts the next batch shifted by the new mean.
+ * @param s - Running stat of the metric
+ * @param n - Number of values already in s
+ * @param batch_n - Number of values in the batch
+ */
+static void fold_stat(struct running_stat *s, unsigned long long n, unsigned long long batch_n, double *total,
+                      double *shift, double *sum, double *sq) {
+    struct running_stat batch;
+    batch.sum = *total;
+    batch.comp = 0;
+    batch.m2 = *sq - *sum * *sum / (double) batch_n;
+    if (batch.m2 < 0) batch.m2 = 0;
+    stat_merge(s, n, &batch, batch_n);
+    *shift = stat_mean(s, n + batch_n);
+    *total = 0;
+    *sum = 0;
+    *sq = 0;
+}
+
+/**
+ * Folds the batch sums of every state into its running stats.
+ * @param states - Table containing climate info structs for every state seen so far
+ */
+static void fold_stats(struct state_table *states) {
+    struct state_columns *totals = &states->totals;
+    for (int i = 0; i < states->num_states; i++) {
+        const unsigned long long n = totals->folded[i];
+        const unsigned long long batch_n = totals->num_records[i] - n;
+        if (batch_n == 0) continue;
+        fold_stat(&totals->temp[i], n, batch_n, &totals->tempTotal[i], &totals->tempShift[i], &totals->tempSum[i],
+                  &totals->tempSq[i]);
+        fold_stat(&totals->humidity[i], n, batch_n, &totals->humidityTotal[i], &totals->humidityShift[i],
+                  &totals->humiditySum[i], &totals->humiditySq[i]);
+        fold_stat(&totals->cloudCover[i], n, batch_n, &totals->cloudCoverTotal[i], &totals->cloudCoverShift[i],
+                  &totals->cloudCoverSum[i], &totals->cloudCoverSq[i]);
+        totals->folded[i] = totals->num_records[i];
+    }
+}
+
+void aggregate_batch(struct state_table *states, const struct record *recs, int count) {
+    for (int i = 0; i < count; i++) aggregate_record(states, &recs[i]);
+    fold_stats(states);
+}
+
+void aggregate_record(struct state_table *states, const struct record *rec) {
+    const time_t currentTS = (time_t) (rec->timestamp / 1000);
+
+    //Find the number of the state to edit, it's created the first time the state shows up
+    COUNTER_ADD(states, new_states, states->slot[rec->key] == 0);
+    const int i = stateFromKey(states, rec->key);
+    struct state_columns *totals = &states->totals;
+    const double temp = rec->kelvin * 1.8 - 459.67;
+
+    //For every record we increment its states record count
+    totals->num_records[i]++;
+    totals->humidityTotal[i] += rec->humidity;
+    const double dh = rec->humidity - totals->humidityShift[i];
+    totals->humiditySum[i] += dh;
+    totals->humiditySq[i] += dh * dh;
+    totals->cloudCoverTotal[i] += rec->cloudCover;
+    const double dc = rec->cloudCover - totals->cloudCoverShift[i];
+    totals->cloudCoverSum[i] += dc;
+    totals->cloudCoverSq[i] += dc * dc;
+    totals->snowCoverCount[i] += rec->snow;
+    totals->lightningStrikeCount[i] += rec->lightning;
+    totals->tempTotal[i] += temp;
+    const double dt = temp - totals->tempShift[i];
+    totals->tempSum[i] += dt;
+    totals->tempSq[i] += dt * dt;
+    //Max
+    if (temp > totals->maxTemp[i]) {
+        COUNTER_ADD(states, max_updates, 1);
+        totals->maxTemp[i] = temp;
+        totals->maxTempTS[i] = currentTS;
+    }
+    //Min
+    if (temp < totals->minTemp[i]) {
+        COUNTER_ADD(states, min_updates, 1);
+        totals->minTemp[i] = temp;
+        totals->minTempTS[i] = currentTS;
+    }
+    if (totals->tempBins[i] != NULL) totals->tempBins[i][temp_bin(temp)]++;
+
+    if (states->bucket != BUCKET_NONE) {
+        struct climate_info *cell = bucket_cell(&states->buckets[i], &states->arena,
+                                                 bucket_of(currentTS, states->bucket));
+        if (cell != NULL) {
+            add_to_info(cell, rec, temp, currentTS);
+        } else states->unbucketed++;
+    }
+    if (rec->cell != 0) {
+        struct climate_info *cell = cell_find(&states->cells, &states->arena, rec->cell);
+        if (cell != NULL) {
+            add_to_info(cell, rec, temp, currentTS);
+        } else states->ungrouped++;
+    } else if (states->geohash > 0) states->ungrouped++;
+}
+
+/**
+ * @return Hash slot a packed geohash key starts probing at, the keys of neighbouring cells only differ in their
+ * low bits so they are mixed with a multiply first
+ */
+static size_t cell_hash(uint64_t key, size_t capacity) {
+    return (size_t) ((key * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+}
+
+/**
+ * Rebuilds the hash slots of a cell table with twice as many slots.
+ * @return 0 on success, -1 if out of memory
+ */
+static int cell_table_grow(struct cell_table *table, struct arena *arena) {
+    const size_t capacity = table->capacity > 0 ? table->capacity * 2 : CELL_TABLE_MIN;
+    uint64_t *keys = arena_alloc(arena, capacity * sizeof(*keys));
+    uint32_t *index = arena_alloc(arena, capacity * sizeof(*index));
+    if (keys == NULL || index == NULL) return -1;
+    memset(keys, 0, capacity * sizeof(*keys));
+    for (size_t i = 0; i < table->num_cells; i++) {
+        size_t slot = cell_hash(table->cells[i].key, capacity);
+        while (keys[slot] != 0) slot = (slot + 1) & (capacity - 1);
+        keys[slot] = table->cells[i].key;
+        index[slot] = (uint32_t) i;
+    }
+    table->keys = keys;
+    table->index = index;
+    table->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Finds the summary of a geohash cell, adding an empty one the first time the cell shows up.
+ * @param table - Cell table
+ * @param arena - Arena of the state table the cell table belongs to
+ * @param key - Packed geohash prefix from geohash_key
+ * @return Summary of the cell, or NULL if out of memory
+ */
+static struct climate_info *cell_find(struct cell_table *table, struct arena *arena, uint64_t key) {
+    if (table->capacity > 0) {
+        size_t slot = cell_hash(key, table->capacity);
+        while (table->keys[slot] != 0) {
+            if (table->keys[slot] == key) return &table->cells[table->index[slot]].info;
+            slot = (slot + 1) & (table->capacity - 1);
+        }
+    }
+
+    //Keep the hash table at most 70% full so probe sequences stay short
+    if ((table->num_cells + 1) * 10 > table->capacity * 7 && cell_table_grow(table, arena) != 0) return NULL;
+    if (table->num_cells == table->cells_capacity) {
+        const size_t capacity = table->cells_capacity > 0 ? table->cells_capacity * 2 : CELL_TABLE_MIN;
+        struct geo_cell *cells = arena_alloc(arena, capacity * sizeof(*cells));
+        if (cells == NULL) return NULL;
+        if (table->num_cells > 0) memcpy(cells, table->cells, table->num_cells * sizeof(*cells));
+        table->cells = cells;
+        table->cells_capacity = capacity;
+    }
+
+    struct geo_cell *cell = &table->cells[table->num_cells];
+    cell->key = key;
+    init_climate_info(&cell->info);
+    size_t slot = cell_hash(key, table->capacity);
+    while (table->keys[slot] != 0) slot = (slot + 1) & (table->capacity - 1);
+    table->keys[slot] = key;
+    table->index[slot] = (uint32_t) table->num_cells++;
+    return &cell->info;
+}
+
+/**
+ * Hands out memory from an arena, taking a new block from malloc when the newest one is full.
+ * @param arena - The arena
+ * @param size - Number of bytes needed
+ * @return ARENA_ALIGN aligned memory that lives until arena_free, or NULL if out of memory
+ */
+static void *arena_alloc(struct arena *arena, size_t size) {
+    //The header is padded so the memory after it is aligned as well
+    const size_t header = (sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (arena->blocks == NULL || (size_t) (arena->end - arena->next) < size) {
+        const size_t len = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        struct arena_block *block = malloc(header + len);
+        if (block == NULL) return NULL;
+        block->prev = arena->blocks;
+        arena->blocks = block;
+        arena->next = (char *) block + header;
+        arena->end = arena->next + len;
+    }
+    void *p = arena->next;
+    arena->next += size;
+    return p;
+}
+
+/**
+ * Gives back every block of an arena and leaves it empty.
+ */
+static void arena_free(struct arena *arena) {
+    while (arena->blocks != NULL) {
+        struct arena_block *prev = arena->blocks->prev;
+        free(arena->blocks);
+        arena->blocks = prev;
+    }
+    arena->next = NULL;
+    arena->end = NULL;
+}
+
+/**
+ * @return a / b rounded down, for bucket numbers before the epoch
+ */
+static long floor_div(long a, long b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+/**
+ * Converts a count of days since 1970-01-01 to a calendar date (Howard Hinnant's days_from_civil inverse).
+ * @param days - Days since the epoch
+ * @param year - Receives the year
+ * @param month - Receives the month, 1 - 12
+ * @param day - Receives the day of the month, 1 - 31
+ */
+static void civil_from_days(long days, long *year, int *month, int *day) {
+    days += 719468;
+    const long era = floor_div(days, 146097);
+    const long doe = days - era * 146097; //Day of the 400 year era
+    const long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365; //Year of the era
+    const long doy = doe - (365 * yoe + yoe / 4 - yoe / 100); //Day of the year, counted from March
+    const long mp = (5 * doy + 2) / 153;
+    *day = (int) (doy - (153 * mp + 2) / 5 + 1);
+    *month = (int) (mp < 10 ? mp + 3 : mp - 9);
+    *year = yoe + era * 400 + (*month <= 2);
+}
+
+/**
+ * @param ts - Time of an observation
+ * @param size - Bucket size
+ * @return Number of the bucket ts falls in, counted from the epoch
+ */
+static long bucket_of(time_t ts, enum bucket_size size) {
+    const long days = floor_div((long) ts, 86400);
+    long year;
+    int month, day;
+    switch (size) {
+        case BUCKET_HOUR:
+            return floor_div((long) ts, 3600);
+        case BUCKET_DAY:
+            return days;
+        default:
+            civil_from_days(days, &year, &month, &day);
+            return year * 12 + month - 1;
+    }
+}
+
+/**
+ * Writes the start of a bucket as a UTC date, e.g. 2015-08-03 18:00, 2015-08-03 or 2015-08.
+ * @param label - Buffer for the label, at least 64 bytes so even out of range years fit
+ * @param bucket - Bucket number from bucket_of
+ * @param size - Bucket size
+ */
+static void bucket_label(char *label, long bucket, enum bucket_size size) {
+    long year;
+    int month, day;
+    switch (size) {
+        case BUCKET_HOUR:
+            civil_from_days(floor_div(bucket, 24), &year, &month, &day);
+            sprintf(label, "%04ld-%02d-%02d %02d:00", year, month, day, (int) (bucket - floor_div(bucket, 24) * 24));
+            break;
+        case BUCKET_DAY:
+            civil_from_days(bucket, &year, &month, &day);
+            sprintf(label, "%04ld-%02d-%02d", year, month, day);
+            break;
+        default:
+            sprintf(label, "%04ld-%02d", floor_div(bucket, 12), (int) (bucket - floor_div(bucket, 12) * 12 + 1));
+            break;
+    }
+}
+
+/**
+ * Finds the summary of a time bucket of a state, widening the dense bucket array of the state to cover it.
+ * @param buckets - Buckets of the state
+ * @param arena - Arena of the state table the buckets belong to
+ * @param bucket - Bucket number from bucket_of
+ * @return Summary of the bucket, or NULL if the array would span more than MAX_BUCKETS or couldn't be grown
+ */
+static struct climate_info *bucket_cell(struct bucket_array *buckets, struct arena *arena, long bucket) {
+    if (buckets->count > 0 && bucket >= buckets->first && bucket < buckets->first + buckets->count) {
+        return &buckets->cells[bucket - buckets->first];
+    }
+
+    long first = buckets->count > 0 ? buckets->first : bucket;
+    long last = buckets->count > 0 ? buckets->first + buckets->count - 1 : bucket;
+    //Smallest range covering the bucket. One timestamp far from the others would need every bucket in between
+    const long needed_first = bucket < first ? bucket : first;
+    const long needed_last = bucket > last ? bucket : last;
+    if (needed_last - needed_first >= MAX_BUCKETS) return NULL;
+    //Grow by at least the current size, so input sorted by time doesn't reallocate for every new bucket
+    const long extra = buckets->count;
+    if (bucket < first) first = bucket < first - extra ? bucket : first - extra;
+    if (bucket > last) last = bucket > last + extra ? bucket : last + extra;
+    if (last - first >= MAX_BUCKETS) {
+        first = needed_first;
+        last = needed_last;
+    }
+
+    const size_t count = (size_t) (last - first + 1);
+    struct climate_info *cells = arena_alloc(arena, count * sizeof(*cells));
+    if (cells == NULL) return NULL;
+    for (size_t i = 0; i < count; i++) init_climate_info(&cells[i]);
+    if (buckets->count > 0) {
+        memcpy(cells + (buckets->first - first), buckets->cells, (size_t) buckets->count * sizeof(*cells));
+    }
+    buckets->cells = cells;
+    buckets->first = first;
+    buckets->count = (int) count;
+    return &buckets->cells[bucket - first];
+}
+
+/**
+ * Adds one record to a summary.
+ * @param ci - Summary of a time bucket or a geohash cell
+ * @param rec - The record
+ * @param temp - Temperature of the record in Fahrenheit
+ * @param currentTS - Time of the record
+ */
+static void add_to_info(struct climate_info *ci, const struct record *rec, double temp, time_t currentTS) {
+    //For every record we increment its states record count
+    ci->num_records++;
+    stat_add(&ci->humidity, ci->num_records, rec->humidity);
+    stat_add(&ci->cloudCover, ci->num_records, rec->cloudCover);
+    if (rec->snow) {
+        ci->snowCoverCount++;
+    }
+    if (rec->lightning) {
+        ci->lightningStrikeCount++;
+    }
+
+    stat_add(&ci->temp, ci->num_records, temp);
+    //Max
+    if (temp > ci->maxTemp) {
+        ci->maxTemp = temp;
+        ci->maxTempTS = currentTS;
+    }
+    //Min
+    if (temp < ci->minTemp) {
+        ci->minTemp = temp;
+        ci->minTempTS = currentTS;
+    }
+}
+
+/**
+ * Builds blocks of a columnar cache file in memory and writes each one out when it is full
+ */
+struct column_writer {
+    FILE *file;
+    int failed; //Set once a write fails or a record can't be encoded
+    struct column_header header;
+    short id_of_key[NUM_STATES]; //State key -> state ID + 1, zero if the state has no ID yet
+    struct column_block block; //Header of the block being built
+    int64_t timestamps[COLUMN_BLOCK_RECORDS];
+    float temperatures[COLUMN_BLOCK_RECORDS];
+    uint8_t state_ids[COLUMN_BLOCK_RECORDS];
+    uint8_t humidity[COLUMN_BLOCK_RECORDS];
+    uint8_t cloudCover[COLUMN_BLOCK_RECORDS];
+    uint8_t snow[COLUMN_BLOCK_RECORDS / 8];
+    uint8_t lightning[COLUMN_BLOCK_RECORDS / 8];
+};
+
+/**
+ * @return Size in bytes of a block holding n records, padding included
+ */
+static size_t column_block_size(size_t n) {
+    const size_t size = sizeof(struct column_block) + n * (sizeof(int64_t) + sizeof(float) + 3) + 2 * ((n + 7) / 8);
+    return (size + 7) & ~(size_t) 7;
+}
+
+/**
+ * @return A percentage rounded to the whole percent stored in the columnar format
+ */
+static uint8_t column_percent(double value) {
+    if (!(value > 0)) return 0;
+    if (value >= 255) return 255;
+    return (uint8_t) (value + 0.5);
+}
+
+struct column_writer *column_writer_open(const char *path) {
+    struct column_writer *writer = calloc(1, sizeof(struct column_writer));
+    if (writer == NULL) return NULL;
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL) {
+        free(writer);
+        return NULL;
+    }
+    memcpy(writer->header.magic, COLUMN_MAGIC, sizeof(writer->header.magic));
+    writer->header.version = COLUMN_VERSION;
+    writer->header.byte_order = COLUMN_BYTE_ORDER;
+    //The header is written again with the final counts when the writer is closed
+    if (fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1) writer->failed = 1;
+    return writer;
+}
+
+/**
+ * Writes out the block being built and starts a new one.
+ * @param writer - Writer from column_writer_open
+ */
+static void column_writer_flush(struct column_writer *writer) {
+    const size_t n = writer->block.num_records;
+    if (n == 0) return;
+    static const char padding[8];
+    const size_t size = column_block_size(n);
+    writer->block.size = (uint32_t) size;
+
+    FILE *f = writer->file;
+    size_t written = fwrite(&writer->block, sizeof(writer->block), 1, f) * sizeof(writer->block);
+    written += fwrite(writer->timestamps, sizeof(int64_t), n, f) * sizeof(int64_t);
+    written += fwrite(writer->temperatures, sizeof(float), n, f) * sizeof(float);
+    written += fwrite(writer->state_ids, 1, n, f);
+    written += fwrite(writer->humidity, 1, n, f);
+    written += fwrite(writer->cloudCover, 1, n, f);
+    written += fwrite(writer->snow, 1, (n + 7) / 8, f);
+    written += fwrite(writer->lightning, 1, (n + 7) / 8, f);
+    written += fwrite(padding, 1, size - written, f);
+    if (written != size) writer->failed = 1;
+
+    writer->header.num_records += n;
+    writer->header.num_blocks++;
+    memset(&writer->block, 0, sizeof(writer->block));
+    memset(writer->snow, 0, sizeof(writer->snow));
+    memset(writer->lightning, 0, sizeof(writer->lightning));
+}
+
+void column_writer_append(struct column_writer *writer, const struct record *rec) {
+    //Give the state an ID the first time it shows up
+    if (writer->id_of_key[rec->key] == 0) {
+        if (writer->header.num_codes == MAX_COLUMN_STATES) {
+            writer->failed = 1;
+            return;
+        }
+        writer->header.codes[writer->header.num_codes][0] = (char) ('A' + rec->key / 26);
+        writer->header.codes[writer->header.num_codes][1] = (char) ('A' + rec->key % 26);
+        writer->id_of_key[rec->key] = (short) ++writer->header.num_codes;
+    }
+    const uint8_t id = (uint8_t) (writer->id_of_key[rec->key] - 1);
+
+    struct column_block *block = &writer->block;
+    const uint32_t i = block->num_records++;
+    if (i == 0 || rec->timestamp < block->min_timestamp) block->min_timestamp = rec->timestamp;
+    if (i == 0 || rec->timestamp > block->max_timestamp) block->max_timestamp = rec->timestamp;
+    block->states_present[id / 64] |= 1ULL << (id % 64);
+
+    writer->timestamps[i] = rec->timestamp;
+    writer->temperatures[i] = (float) rec->kelvin;
+    writer->state_ids[i] = id;
+    writer->humidity[i] = column_percent(rec->humidity);
+    writer->cloudCover[i] = column_percent(rec->cloudCover);
+    writer->snow[i / 8] |= (uint8_t) (rec->snow << (i % 8));
+    writer->lightning[i / 8] |= (uint8_t) (rec->lightning << (i % 8));
+
+    if (block->num_records == COLUMN_BLOCK_RECORDS) column_writer_flush(writer);
+}
+
+int column_writer_close(struct column_writer *writer, unsigned long long *num_records) {
+    column_writer_flush(writer);
+    *num_records = writer->header.num_records;
+    if (fseek(writer->file, 0, SEEK_SET) != 0
+        || fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1) {
+        writer->failed = 1;
+    }
+    if (fclose(writer->file) != 0) writer->failed = 1;
+    const int failed = writer->failed;
+    free(writer);
+    return failed ? -1 : 0;
+}
+
+int analyze_columnar(const char *buf, size_t len, struct state_table *states) {
+    const struct column_header *header = (const struct column_header *) buf;
+    if (len < sizeof(*header) || header->version != COLUMN_VERSION || header->byte_order != COLUMN_BYTE_ORDER
+        || header->num_codes > MAX_COLUMN_STATES) {
+        return -1;
+    }
+    //State ID -> state key, and whether the filter wants the state
+    int key_of_id[MAX_COLUMN_STATES];
+    unsigned char keep_id[MAX_COLUMN_STATES];
+    uint64_t keep_mask[MAX_COLUMN_STATES / 64] = {0};
+    const struct record_filter *filter = states->filter;
+    for (uint32_t id = 0; id < header->num_codes; id++) {
+        key_of_id[id] = state_key(header->codes[id], 2);
+        if (key_of_id[id] < 0) return -1;
+        keep_id[id] = filter == NULL || !filter->by_state || filter->keep[key_of_id[id]];
+        if (keep_id[id]) keep_mask[id / 64] |= 1ULL << (id % 64);
+    }
+
+    COUNTER_START(parsing);
+    COUNTER_ADD(states, bytes_read, len);
+    const char *p = buf + sizeof(*header);
+    const char *end = buf + len;
+    struct record_batch batch;
+    batch.count = 0;
+    int status = 0;
+    for (uint64_t b = 0; b < header->num_blocks && status == 0; b++) {
+        const struct column_block *block = (const struct column_block *) p;
+        if ((size_t) (end - p) < sizeof(*block)) {
+            status = -1;
+            break;
+        }
+        const size_t n = block->num_records;
+        if (n > COLUMN_BLOCK_RECORDS || block->size != column_block_size(n) || (size_t) (end - p) < block->size) {
+            status = -1;
+            break;
+        }
+
+        if (filter != NULL) {
+            //Blocks without any wanted state or time are skipped whole, using the ranges in their header
+            int wanted = 0;
+            for (int w = 0; w < MAX_COLUMN_STATES / 64; w++) wanted |= (block->states_present[w] & keep_mask[w]) != 0;
+            if (!wanted || block->max_timestamp / 1000 < filter->from || block->min_timestamp / 1000 >= filter->to) {
+                COUNTER_ADD(states, filtered, 1);
+                p += block->size;
+                continue;
+            }
+        }
+
+        const int64_t *timestamps = (const int64_t *) (p + sizeof(*block));
+        const float *temperatures = (const float *) (timestamps + n);
+        const uint8_t *state_ids = (const uint8_t *) (temperatures + n);
+        const uint8_t *humidity = state_ids + n;
+        const uint8_t *cloudCover = humidity + n;
+        const uint8_t *snow = cloudCover + n;
+        const uint8_t *lightning = snow + (n + 7) / 8;
+
+        for (size_t i = 0; i < n; i++) {
+            if (state_ids[i] >= header->num_codes) {
+                status = -1;
+                break;
+            }
+            if (filter != NULL && (!keep_id[state_ids[i]] || timestamps[i] / 1000 < filter->from
+                                   || timestamps[i] / 1000 >= filter->to)) {
+                COUNTER_ADD(states, filtered, 1);
+                continue;
+            }
+            struct record *rec = &batch.recs[batch.count];
+            rec->key = key_of_id[state_ids[i]];
+            rec->timestamp = (long) timestamps[i];
+            rec->humidity = humidity[i];
+            rec->cloudCover = cloudCover[i];
+            rec->kelvin = temperatures[i];
+            rec->snow = snow[i / 8] >> (i % 8) & 1;
+            rec->lightning = lightning[i / 8] >> (i % 8) & 1;
+            rec->cell = 0;
+            if (++batch.count == BATCH_SZ) flush_batch(states, &batch);
+        }
+        p += block->size;
+    }
+    //Whatever decoded before any damage is still summarized
+    flush_batch(states, &batch);
+    COUNTER_STOP(states, ingest_ns, parsing);
+    return status;
+}
+
+/**
+ * Adds an empty entry to a checkpoint, growing its array as needed.
+ * @param cp - Checkpoint to add to
+ * @return The new entry, or NULL if there's no memory for it
+ */
+static struct checkpoint_file *checkpoint_add(struct checkpoint *cp) {
+    if (cp->num_files == cp->capacity) {
+        const int capacity = cp->capacity == 0 ? 16 : cp->capacity * 2;
+        struct checkpoint_file *grown = realloc(cp->files, (size_t) capacity * sizeof(*grown));
+        if (grown == NULL) return NULL;
+        cp->files = grown;
+        cp->capacity = capacity;
+    }
+    struct checkpoint_file *entry = &cp->files[cp->num_files++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+int load_checkpoint(const char *path, struct state_table *states, struct checkpoint *cp) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return errno == ENOENT ? 0 : -1;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    int status = 0;
+    int version = 0;
+    char code[3];
+    struct climate_info saved;
+    unsigned long long dev, ino, offset;
+    long long maxTS, minTS;
+    int path_start;
+
+    if (getline(&line, &line_cap, file) < 0 || sscanf(line, CHECKPOINT_MAGIC " %d", &version) != 1
+        || version != CHECKPOINT_VERSION) {
+        status = -1;
+    }
+    while (status == 0 && getline(&line, &line_cap, file) >= 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "malformed ", 10) == 0) {
+            if (sscanf(line + 10, "%llu", &states->malformed) != 1) status = -1;
+        } else if (strncmp(line, "state ", 6) == 0) {
+            if (sscanf(line + 6, "%2s %llu %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lld %lf %lld %d %d", code,
+                       &saved.num_records, &saved.temp.sum, &saved.temp.comp, &saved.temp.m2, &saved.humidity.sum,
+                       &saved.humidity.comp, &saved.humidity.m2, &saved.cloudCover.sum, &saved.cloudCover.comp,
+                       &saved.cloudCover.m2, &saved.maxTemp, &maxTS, &saved.minTemp, &minTS,
+                       &saved.lightningStrikeCount, &saved.snowCoverCount) != 17) {
+                status = -1;
+                break;
+            }
+            const int key = state_key(code, strlen(code));
+            if (key < 0) {
+                status = -1;
+                break;
+            }
+            saved.maxTempTS = (time_t) maxTS;
+            saved.minTempTS = (time_t) minTS;
+            add_summary(states, stateFromKey(states, key), &saved);
+        } else if (strncmp(line, "sketch ", 7) == 0) {
+            //Histogram of a state saved on the line before, as bin:count pairs
+            int used;
+            const int key = sscanf(line + 7, "%2s%n", code, &used) == 1 ? state_key(code, strlen(code)) : -1;
+            if (key < 0 || states->slot[key] == 0) {
+                status = -1;
+                break;
+            }
+            uint64_t *bins = states->totals.tempBins[states->slot[key] - 1];
+            int bin;
+            unsigned long long count;
+            int step;
+            for (const char *p = line + 7 + used; status == 0 && *p != '\0'; p += step) {
+                if (sscanf(p, " %d:%llu%n", &bin, &count, &step) != 2 || bin < 0 || bin >= TEMP_SKETCH_BINS) {
+                    status = -1;
+                } else if (bins != NULL) bins[bin] += count;
+            }
+        } else if (strncmp(line, "file ", 5) == 0) {
+            if (sscanf(line + 5, "%llu %llu %llu %n", &dev, &ino, &offset, &path_start) != 3) {
+                status = -1;
+                break;
+            }
+            struct checkpoint_file *entry = checkpoint_add(cp);
+            if (entry == NULL) {
+                status = -1;
+                break;
+            }
+            entry->dev = dev;
+            entry->ino = ino;
+            entry->offset = offset;
+            entry->path = strdup(line + 5 + path_start);
+        } else if (line[0] != '\0') status = -1;
+    }
+
+    free(line);
+    fclose(file);
+    return status;
+}
+
+int save_checkpoint(const char *path, struct state_table *states, struct checkpoint *cp) {
+    const size_t tmp_len = strlen(path) + 5;
+    char *tmp = malloc(tmp_len);
+    if (tmp == NULL) return -1;
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+
+    FILE *file = fopen(tmp, "w");
+    if (file == NULL) {
+        free(tmp);
+        return -1;
+    }
+    fprintf(file, CHECKPOINT_MAGIC " %d\n", CHECKPOINT_VERSION);
+    fprintf(file, "malformed %llu\n", states->malformed);
+    for (int i = 0; i < states->num_states; i++) {
+        struct climate_info ci;
+        state_summary(states, i, &ci);
+        fprintf(file, "state %s %llu %a %a %a %a %a %a %a %a %a %a %lld %a %lld %d %d\n", ci.code, ci.num_records,
+                ci.temp.sum, ci.temp.comp, ci.temp.m2, ci.humidity.sum, ci.humidity.comp, ci.humidity.m2,
+                ci.cloudCover.sum, ci.cloudCover.comp, ci.cloudCover.m2, ci.maxTemp, (long long) ci.maxTempTS,
+                ci.minTemp, (long long) ci.minTempTS, ci.lightningStrikeCount, ci.snowCoverCount);
+        const uint64_t *bins = states->totals.tempBins[i];
+        if (bins == NULL) continue;
+        fprintf(file, "sketch %s", ci.code);
+        for (int b = 0; b < TEMP_SKETCH_BINS; b++) {
+            if (bins[b] != 0) fprintf(file, " %d:%llu", b, (unsigned long long) bins[b]);
+        }
+        fprintf(file, "\n");
+    }
+    for (int i = 0; i < cp->num_files; i++) {
+        const struct checkpoint_file *entry = &cp->files[i];
+        fprintf(file, "file %llu %llu %llu %s\n", entry->dev, entry->ino, entry->offset,
+                entry->path != NULL ? entry->path : "");
+    }
+
+    int status = ferror(file) ? -1 : 0;
+    if (fclose(file) != 0) status = -1;
+    if (status == 0 && rename(tmp, path) != 0) status = -1;
+    if (status != 0) remove(tmp);
+    free(tmp);
+    return status;
+}
+
+int analyze_appended(int fd, const char *path, struct checkpoint *cp, struct state_table *states, int num_threads) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        printf("--checkpoint needs regular files, %s can't be resumed\n", path);
+        return -1;
+    }
+
+    //Find the file in the checkpoint, or start tracking it from its first byte
+    struct checkpoint_file *entry = NULL;
+    for (int i = 0; i < cp->num_files; i++) {
+        if (cp->files[i].dev == (unsigned long long) st.st_dev && cp->files[i].ino == (unsigned long long) st.st_ino) {
+            entry = &cp->files[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        entry = checkpoint_add(cp);
+        if (entry == NULL) return -1;
+        entry->dev = (unsigned long long) st.st_dev;
+        entry->ino = (unsigned long long) st.st_ino;
+    }
+    free(entry->path);
+    entry->path = strdup(path);
+
+    const unsigned long long size = (unsigned long long) st.st_size;
+    if (size < entry->offset) {
+        printf("%s is shorter than when the checkpoint was saved, it can only be appended to\n", path);
+        return -1;
+    }
+    if (size == entry->offset) return 0; //Nothing new
+
+    size_t len;
+    COUNTER_START(mapping);
+    const char *map = map_file(fd, &len);
+    COUNTER_STOP(states, io_ns, mapping);
+    if (map == NULL) return -1;
+    int status = 0;
+
+    if (len >= sizeof(COLUMN_MAGIC) - 1 && memcmp(map, COLUMN_MAGIC, sizeof(COLUMN_MAGIC) - 1) == 0) {
+        //Columnar files are written once, so they are either fully summarized or not at all
+        if (entry->offset == 0 && analyze_columnar(map, len, states) == 0) {
+            entry->offset = len;
+        } else status = -1;
+        munmap((void *) map, len);
+        return status;
+    }
+
+    //Parse up to and including the last newline, whatever follows it is an unfinished record
+    const char *start = map + entry->offset;
+    const char *end = map + len;
+    const char *complete = end;
+    while (complete > start && complete[-1] != '\n') complete--;
+
+    if (num_threads > 1) {
+        analyze_parallel(start, (size_t) (complete - start), states, num_threads);
+    } else analyze_buffer(start, (size_t) (complete - start), states);
+    entry->offset = (unsigned long long) (complete - map);
+
+    entry->tail_len = (size_t) (end - complete);
+    if (entry->tail_len > 0) {
+        entry->tail = malloc(entry->tail_len);
+        if (entry->tail != NULL) {
+            memcpy(entry->tail, complete, entry->tail_len);
+        } else status = -1;
+    }
+    munmap((void *) map, len);
+    return status;
+}
+
+void finish_checkpoint(struct checkpoint *cp, struct state_table *states) {
+    for (int i = 0; i < cp->num_files; i++) {
+        if (cp->files[i].tail != NULL) analyze_buffer(cp->files[i].tail, cp->files[i].tail_len, states);
+        free(cp->files[i].tail);
+        free(cp->files[i].path);
+    }
+    free(cp->files);
+    cp->files = NULL;
+    cp->num_files = 0;
+    cp->capacity = 0;
+}
+
+void free_states(struct state_table *states) {
+    //Everything the accumulators allocated lives in the arena
+    arena_free(&states->arena);
+    memset(states->buckets, 0, sizeof(states->buckets));
+    memset(states->slot, 0, sizeof(states->slot));
+    states->num_states = 0;
+    states->malformed = 0;
+    states->unbucketed = 0;
+    states->ungrouped = 0;
+    states->aggregate_time = 0;
+    memset(&states->cells, 0, sizeof(states->cells));
+#ifdef CLIMATE_COUNTERS
+    memset(&states->counters, 0, sizeof(states->counters));
+#endif
+}
+
+void print_report(FILE *out, struct state_table *states) {
+    fprintf(out, "States found:\n");
+    int i;
+    for (i = 0; i < states->num_states; ++i) {
+        fprintf(out, "%s ", states->codes[i]);
+    }
+    fprintf(out, "\n");
+
+    for (i = 0; i < states->num_states; i++) {
+        struct climate_info info;
+        state_summary(states, i, &info);
+        fprintf(out, "-- State: %s --\n", info.code);
+        fprintf(out, "Number of Records: %llu\n", info.num_records);
+        if (!(states->hidden_metrics & METRIC_HUMIDITY)) {
+            fprintf(out, "Average Humidity: %.1f%%\n", stat_mean(&info.humidity, info.num_records));
+            fprintf(out, "Humidity Standard Deviation: %.1f%%\n", stat_stddev(&info.humidity, info.num_records));
+        }
+        if (!(states->hidden_metrics & METRIC_TEMP)) {
+            fprintf(out, "Average Temperature: %.1fF\n", stat_mean(&info.temp, info.num_records));
+            fprintf(out, "Temperature Standard Deviation: %.1fF\n", stat_stddev(&info.temp, info.num_records));
+            const uint64_t *bins = states->totals.tempBins[i];
+            if (bins != NULL) {
+                fprintf(out, "Median Temperature: %.1fF\n",
+                        temp_quantile(bins, info.num_records, 0.5, info.minTemp, info.maxTemp));
+                fprintf(out, "95th Percentile Temperature: %.1fF\n",
+                        temp_quantile(bins, info.num_records, 0.95, info.minTemp, info.maxTemp));
+            }
+            fprintf(out, "Max Temperature: %.1fF\n", info.maxTemp);
+            fprintf(out, "Max Temperature on: %s", ctime(&info.maxTempTS));
+            fprintf(out, "Min Temperature: %.1fF\n", info.minTemp);
+            fprintf(out, "Min Temperature on: %s", ctime(&info.minTempTS));
+        }
+        if (!(states->hidden_metrics & METRIC_LIGHTNING)) {
+            fprintf(out, "Lightning Strikes: %d\n", info.lightningStrikeCount);
+        }
+        if (!(states->hidden_metrics & METRIC_SNOW)) fprintf(out, "Records with Snow Cover: %d\n", info.snowCoverCount);
+        if (!(states->hidden_metrics & METRIC_CLOUD)) {
+            fprintf(out, "Average Cloud Cover: %.1f%%\n", stat_mean(&info.cloudCover, info.num_records));
+            fprintf(out, "Cloud Cover Standard Deviation: %.1f%%\n",
+                    stat_stddev(&info.cloudCover, info.num_records));
+        }
+    }
+    fprintf(out, "\n");
+}
+
+
+void print_buckets(FILE *out, struct state_table *states) {
+    static const char *const names[] = {"", "hour", "day", "month"};
+    char label[64];
+    fprintf(out, "-- Summary by %s (UTC) --\n", names[states->bucket]);
+    for (int i = 0; i < states->num_states; i++) {
+        const struct bucket_array *buckets = &states->buckets[i];
+        fprintf(out, "-- State: %s --\n", states->codes[i]);
+        fprintf(out, "%-16s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "Bucket", "Records", "Humidity", "AvgTemp",
+                "TempSD", "MaxTemp", "MinTemp", "Lightning", "Snow", "Cloud");
+        for (int b = 0; b < buckets->count; b++) {
+            const struct climate_info *cell = &buckets->cells[b];
+            if (cell->num_records == 0) continue;
+            bucket_label(label, buckets->first + b, states->bucket);
+            const unsigned long long n = cell->num_records;
+            fprintf(out, "%-16s %9llu %8.1f%% %8.1fF %8.1fF %8.1fF %8.1fF %9d %9d %8.1f%%\n", label, n,
+                    stat_mean(&cell->humidity, n), stat_mean(&cell->temp, n), stat_stddev(&cell->temp, n),
+                    cell->maxTemp, cell->minTemp, cell->lightningStrikeCount, cell->snowCoverCount,
+                    stat_mean(&cell->cloudCover, n));
+        }
+    }
+    fprintf(out, "\n");
+}
+
+/**
+ * qsort comparison of geohash cells by key, which is geohash order for keys of the same length
+ */
+static int compare_cells(const void *a, const void *b) {
+    const uint64_t x = ((const struct geo_cell *) a)->key;
+    const uint64_t y = ((const struct geo_cell *) b)->key;
+    return (x > y) - (x < y);
+}
+
+void print_cells(FILE *out, struct state_table *states) {
+    static const char alphabet[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+    struct cell_table *table = &states->cells;
+    char label[MAX_GEOHASH + 1];
+    //The hash slots point into the cells array, so they go stale once it's sorted
+    if (table->num_cells > 0) qsort(table->cells, table->num_cells, sizeof(*table->cells), compare_cells);
+    table->keys = NULL;
+    table->index = NULL;
+    table->capacity = 0;
+
+    fprintf(out, "-- Summary by geohash cell (precision %d) --\n", states->geohash);
+    fprintf(out, "%-12s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "Cell", "Records", "Humidity", "AvgTemp", "TempSD",
+            "MaxTemp", "MinTemp", "Lightning", "Snow", "Cloud");
+    for (size_t i = 0; i < table->num_cells; i++) {
+        const struct geo_cell *cell = &table->cells[i];
+        const int len = (int) (cell->key & 15);
+        for (int c = 0; c < len; c++) label[c] = alphabet[cell->key >> (4 + 5 * (len - 1 - c)) & 31];
+        label[len] = '\0';
+        const struct climate_info *info = &cell->info;
+        const unsigned long long n = info->num_records;
+        fprintf(out, "%-12s %9llu %8.1f%% %8.1fF %8.1fF %8.1fF %8.1fF %9d %9d %8.1f%%\n", label, n,
+                stat_mean(&info->humidity, n), stat_mean(&info->temp, n), stat_stddev(&info->temp, n),
+                info->maxTemp, info->minTemp, info->lightningStrikeCount, info->snowCoverCount,
+                stat_mean(&info->cloudCover, n));
+    }
+    fprintf(out, "\n");
+}
+
+/**
+ * Appends formatted text to a buffer that was sized for it, truncating rather than overflowing if it wasn't.
+ * @param buf - Start of the buffer
+ * @param len - Bytes already used, advanced past the text
+ * @param capacity - Size of the buffer
+ * @param fmt - printf format
+ */
+static void buffer_printf(char *buf, size_t *len, size_t capacity, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    const int n = vsnprintf(buf + *len, capacity - *len, fmt, args);
+    va_end(args);
+    if (n > 0) *len += (size_t) n < capacity - *len ? (size_t) n : capacity - *len - 1;
+}
+
+/**
+ * Appends the mean, standard deviation, total and M2 of one metric as csv fields or json members.
+ * @param name - Name of the metric, the json object it goes in
+ */
+static void buffer_stat(char *buf, size_t *len, size_t capacity, enum output_format format, const char *name,
+                        const struct running_stat *s, unsigned long long n) {
+    const char *fmt = format == FORMAT_CSV ? ",%.17g,%.17g,%.17g,%.17g"
+                                           : ",\"%s\":{\"mean\":%.17g,\"sd\":%.17g,\"total\":%.17g,\"m2\":%.17g}";
+    if (format == FORMAT_CSV) {
+        buffer_printf(buf, len, capacity, fmt, stat_mean(s, n), stat_stddev(s, n), s->sum + s->comp, s->m2);
+    } else buffer_printf(buf, len, capacity, fmt, name, stat_mean(s, n), stat_stddev(s, n), s->sum + s->comp, s->m2);
+}
+
+/**
+ * Writes a whole buffer, retrying short and interrupted writes.
+ * @return 0 on success, -1 if a write failed
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        const ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+int write_summaries(int fd, struct state_table *states, enum output_format format) {
+    const size_t capacity = format == FORMAT_BINARY
+                            ? sizeof(struct summary_header) + (size_t) states->num_states * sizeof(struct summary_state)
+                            : (size_t) (states->num_states + 1) * SUMMARY_LINE_SZ;
+    char *buf = malloc(capacity);
+    if (buf == NULL) return -1;
+    size_t len = 0;
+
+    if (format == FORMAT_BINARY) {
+        struct summary_header *header = (struct summary_header *) buf;
+        memset(buf, 0, capacity);
+        memcpy(header->magic, SUMMARY_MAGIC, sizeof(header->magic));
+        header->version = SUMMARY_VERSION;
+        header->byte_order = COLUMN_BYTE_ORDER;
+        header->num_states = (uint32_t) states->num_states;
+        header->malformed = states->malformed;
+        struct summary_state *out = (struct summary_state *) (header + 1);
+        for (int i = 0; i < states->num_states; i++) {
+            struct climate_info info;
+            state_summary(states, i, &info);
+            memcpy(out[i].code, info.code, sizeof(out[i].code));
+            out[i].num_records = info.num_records;
+            const struct running_stat *stats[] = {&info.temp, &info.humidity, &info.cloudCover};
+            double *raw[] = {out[i].temp, out[i].humidity, out[i].cloudCover};
+            for (int m = 0; m < 3; m++) {
+                raw[m][0] = stats[m]->sum;
+                raw[m][1] = stats[m]->comp;
+                raw[m][2] = stats[m]->m2;
+            }
+            out[i].maxTemp = info.maxTemp;
+            out[i].minTemp = info.minTemp;
+            out[i].maxTempTS = (int64_t) info.maxTempTS;
+            out[i].minTempTS = (int64_t) info.minTempTS;
+            out[i].lightningStrikeCount = (uint64_t) info.lightningStrikeCount;
+            out[i].snowCoverCount = (uint64_t) info.snowCoverCount;
+            if (states->totals.tempBins[i] != NULL) {
+                memcpy(out[i].tempBins, states->totals.tempBins[i], sizeof(out[i].tempBins));
+            }
+        }
+        len = capacity;
+    } else {
+        if (format == FORMAT_CSV) {
+            buffer_printf(buf, &len, capacity, "state,records,humidity_mean,humidity_sd,humidity_total,humidity_m2,"
+                          "temp_mean,temp_sd,temp_total,temp_m2,cloud_mean,cloud_sd,cloud_total,cloud_m2,"
+                          "max_temp,max_temp_time,min_temp,min_temp_time,lightning_strikes,snow_cover,"
+                          "temp_p50,temp_p95\n");
+        } else buffer_printf(buf, &len, capacity, "{\"malformed\":%llu,\"states\":[", states->malformed);
+        for (int i = 0; i < states->num_states; i++) {
+            struct climate_info info;
+            state_summary(states, i, &info);
+            const unsigned long long n = info.num_records;
+            if (format == FORMAT_CSV) {
+                buffer_printf(buf, &len, capacity, "%s,%llu", info.code, n);
+            } else buffer_printf(buf, &len, capacity, "%s{\"state\":\"%s\",\"records\":%llu", i > 0 ? "," : "",
+                                 info.code, n);
+            buffer_stat(buf, &len, capacity, format, "humidity", &info.humidity, n);
+            buffer_stat(buf, &len, capacity, format, "temp", &info.temp, n);
+            buffer_stat(buf, &len, capacity, format, "cloud", &info.cloudCover, n);
+            const char *fmt = format == FORMAT_CSV ? ",%.17g,%lld,%.17g,%lld,%d,%d,%.17g,%.17g\n"
+                                                   : ",\"max_temp\":%.17g,\"max_temp_time\":%lld,\"min_temp\":%.17g,"
+                                                     "\"min_temp_time\":%lld,\"lightning_strikes\":%d,"
+                                                     "\"snow_cover\":%d,\"temp_p50\":%.17g,\"temp_p95\":%.17g}";
+            const uint64_t *bins = states->totals.tempBins[i];
+            const double p50 = bins != NULL ? temp_quantile(bins, n, 0.5, info.minTemp, info.maxTemp) : 0;
+            const double p95 = bins != NULL ? temp_quantile(bins, n, 0.95, info.minTemp, info.maxTemp) : 0;
+            buffer_printf(buf, &len, capacity, fmt, info.maxTemp, (long long) info.maxTempTS, info.minTemp,
+                          (long long) info.minTempTS, info.lightningStrikeCount, info.snowCoverCount, p50, p95);
+        }
+        if (format == FORMAT_JSON) buffer_printf(buf, &len, capacity, "]}\n");
+    }
+
+    const int status = write_all(fd, buf, len);
+    free(buf);
+    return status;
+}
+
+/**
+ * Reads the rest of a descriptor that can't be mapped into memory.
+ * @param fd - Descriptor to read
+ * @param len - Receives the number of bytes read
+ * @return Buffer to free, or NULL if out of memory or a read failed
+ */
+static char *read_whole(int fd, size_t *len) {
+    size_t capacity = READ_BUF_SZ;
+    char *buf = malloc(capacity);
+    *len = 0;
+    while (buf != NULL) {
+        if (*len == capacity) {
+            char *bigger = realloc(buf, capacity * 2);
+            if (bigger == NULL) break;
+            buf = bigger;
+            capacity *= 2;
+        }
+        const ssize_t got = read(fd, buf + *len, capacity - *len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) break;
+        if (got == 0) return buf;
+        *len += (size_t) got;
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Merges the summaries of a whole binary summary file into the table.
+ * @return 0 on success, -1 if the file is damaged
+ */
+static int merge_summaries(const char *buf, size_t len, struct state_table *states) {
+    const struct summary_header *header = (const struct summary_header *) buf;
+    if (len < sizeof(*header) || memcmp(header->magic, SUMMARY_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SUMMARY_VERSION || header->byte_order != COLUMN_BYTE_ORDER
+        || header->num_states > NUM_STATES
+        || len != sizeof(*header) + (size_t) header->num_states * sizeof(struct summary_state)) {
+        return -1;
+    }
+    //The entries are copied out since a read buffer is only as aligned as malloc made it
+    struct summary_state entry;
+    const char *p = buf + sizeof(*header);
+    for (uint32_t s = 0; s < header->num_states; s++) {
+        memcpy(&entry, p + s * sizeof(entry), sizeof(entry));
+        if (state_key(entry.code, 2) < 0 || entry.num_records == 0) return -1;
+    }
+
+    for (uint32_t s = 0; s < header->num_states; s++) {
+        memcpy(&entry, p + s * sizeof(entry), sizeof(entry));
+        struct climate_info info;
+        struct running_stat *stats[] = {&info.temp, &info.humidity, &info.cloudCover};
+        const double *raw[] = {entry.temp, entry.humidity, entry.cloudCover};
+        for (int m = 0; m < 3; m++) {
+            stats[m]->sum = raw[m][0];
+            stats[m]->comp = raw[m][1];
+            stats[m]->m2 = raw[m][2];
+        }
+        info.num_records = entry.num_records;
+        info.maxTemp = entry.maxTemp;
+        info.minTemp = entry.minTemp;
+        info.maxTempTS = (time_t) entry.maxTempTS;
+        info.minTempTS = (time_t) entry.minTempTS;
+        info.lightningStrikeCount = (int) entry.lightningStrikeCount;
+        info.snowCoverCount = (int) entry.snowCoverCount;
+        const int i = stateFromKey(states, state_key(entry.code, 2));
+        add_summary(states, i, &info);
+        //The entry was copied out, so its histogram is aligned
+        sketch_merge(states->totals.tempBins[i], entry.tempBins);
+    }
+    states->malformed += header->malformed;
+    return 0;
+}
+
+int merge_summary_file(const char *path, struct state_table *states) {
+    const int is_stdin = strcmp(path, "-") == 0;
+    const int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) return FILE_MISSING;
+
+    size_t len;
+    const char *map = is_stdin && lseek(fd, 0, SEEK_CUR) != 0 ? NULL : map_file(fd, &len);
+    char *buf = map == NULL ? read_whole(fd, &len) : NULL;
+    int status = FILE_FAILED;
+    if (map != NULL || buf != NULL) {
+        status = merge_summaries(map != NULL ? map : buf, len, states) == 0 ? FILE_OK : FILE_FAILED;
+    }
+    if (map != NULL) munmap((void *) map, len);
+    free(buf);
+    if (!is_stdin) close(fd);
+    return status;
+}
+
+/**
+ * @return Seconds on the monotonic clock
+ */
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int run_benchmark(char *files[], int num_files, int iterations, int num_threads) {
+    static struct state_table states;
+    states.skip_fields = projection_skip(METRIC_ALL, BUCKET_NONE, 0);
+    states.decode = select_decoder(states.skip_fields);
+    FILE *sink = fopen("/dev/null", "w");
+    if (sink == NULL) {
+        printf("Error opening /dev/null\n");
+        return EXIT_FAILURE;
+    }
+
+    //Seconds spent in each phase, summed over every iteration. The parse time includes aggregating and
+    //aggregate_time is the part of it spent aggregating batches, summed over threads
+    double open_time = 0, parse_time = 0, aggregate_time = 0, report_time = 0;
+    //Work done per iteration
+    unsigned long long records = 0;
+    size_t bytes = 0;
+    //Fastest full iteration
+    double best = 0;
+
+    for (int it = 0; it < iterations; it++) {
+        const double start = bench_now();
+        bytes = 0;
+        states.timed = 1;
+        for (int f = 0; f < num_files; f++) {
+            double t0 = bench_now();
+            int fd = open(files[f], O_RDONLY);
+            size_t len = 0;
+            const char *map = fd >= 0 ? map_file(fd, &len) : NULL;
+            double t1 = bench_now();
+            if (map == NULL) {
+                printf("Error File %s can't be mapped, the benchmark needs regular files\n", files[f]);
+                if (fd >= 0) close(fd);
+                fclose(sink);
+                free_states(&states);
+                return EXIT_FAILURE;
+            }
+
+            analyze_mapping(map, len, &states, num_threads);
+            double t2 = bench_now();
+
+            munmap((void *) map, len);
+            close(fd);
+            open_time += t1 - t0 + bench_now() - t2;
+            parse_time += t2 - t1;
+            bytes += len;
+        }
+
+        double t3 = bench_now();
+        print_report(sink, &states);
+        fflush(sink);
+        double t4 = bench_now();
+        report_time += t4 - t3;
+
+        records = 0;
+        for (int i = 0; i < states.num_states; i++) records += states.totals.num_records[i];
+        aggregate_time += states.aggregate_time;
+        free_states(&states);
+
+        if (it == 0 || t4 - start < best) best = t4 - start;
+    }
+    fclose(sink);
+
+    const double total = open_time + parse_time + report_time;
+    const double mb = (double) bytes / (1024.0 * 1024.0);
+    printf("Benchmark: %d iteration(s), %d thread(s), %d file(s)\n", iterations, num_threads, num_files);
+    printf("Per iteration: %llu records, %.2f MB\n", records, mb);
+    printf("%-18s %12s %12s\n", "Phase", "Total (s)", "Mean (ms)");
+    printf("%-18s %12.4f %12.3f\n", "open", open_time, open_time * 1000 / iterations);
+    if (num_threads == 1) {
+        printf("%-18s %12.4f %12.3f\n", "parse", parse_time - aggregate_time,
+               (parse_time - aggregate_time) * 1000 / iterations);
+        printf("%-18s %12.4f %12.3f\n", "aggregate", aggregate_time, aggregate_time * 1000 / iterations);
+    } else {
+        //Threads aggregate at the same time, so only the wall time of both stages together is meaningful
+        printf("%-18s %12.4f %12.3f\n", "parse+aggregate", parse_time, parse_time * 1000 / iterations);
+        printf("%-18s %12.4f %12.3f\n", " aggregate (cpu)", aggregate_time, aggregate_time * 1000 / iterations);
+    }
+    printf("%-18s %12.4f %12.3f\n", "report", report_time, report_time * 1000 / iterations);
+    printf("%-18s %12.4f %12.3f\n", "total", total, total * 1000 / iterations);
+    printf("Mean throughput: %.0f records/sec, %.1f MB/sec\n",
+           (double) records * iterations / total, mb * iterations / total);
+    printf("Best iteration: %.3f ms, %.0f records/sec, %.1f MB/sec\n",
+           best * 1000, (double) records / best, mb / best);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,348 @@
+/**
+ * gen_tdv.c
+ *
+ * Writes synthetic NOAA style climate records in the nine field TDV format climate.c reads, for benchmarking
+ * climate on inputs far larger than the bundled data files.
+ *
+ * Compile:  make gen-tdv
+ *
+ * Example Run:      ./gen-tdv --size=1G --skew=1.1 --malformed=0.001 -o big.tdv
+ *                   ./gen-tdv --size=64M | ./climate -
+ *
+ * Options:
+ *      --size=N[K|M|G|T]   Bytes to write, the last record may run past it (default 1G)
+ *      --skew=S            Zipf exponent of the state distribution, 0 for uniform (default 1.0)
+ *      --malformed=RATE    Fraction of lines that are malformed, between 0 and 1 (default 0)
+ *      --seed=N            Seed of the generator, the same seed and options write the same bytes (default 1)
+ *      -o FILE             File to write to instead of stdout
+ *
+ * Malformed lines are a mix of records cut short, records with a non numeric field and records with too many
+ * fields, which climate counts as malformed, plus empty lines, which it ignores.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OUT_BUFFER_SZ (1 << 20) //Output is written in chunks of this many bytes
+#define MAX_LINE 256 //Longest line the generator writes, malformed ones included
+#define FIRST_TS 1420070400000LL //Observations are spread over 2015 and 2016, in milliseconds
+#define TS_RANGE (731LL * 24 * 60 * 60 * 1000)
+#define GEOHASH_LEN 12
+
+//The 50 states and DC, in the order their Zipf ranks are dealt out before shuffling
+static const char *const codes[] = {
+        "AL", "AK", "AZ", "AR", "CA", "CO", "CT", "DE", "DC", "FL", "GA", "HI", "ID", "IL", "IN", "IA", "KS",
+        "KY", "LA", "ME", "MD", "MA", "MI", "MN", "MS", "MO", "MT", "NE", "NV", "NH", "NJ", "NM", "NY", "NC",
+        "ND", "OH", "OK", "OR", "PA", "RI", "SC", "SD", "TN", "TX", "UT", "VT", "VA", "WA", "WV", "WI", "WY"};
+#define NUM_CODES ((int) (sizeof(codes) / sizeof(codes[0])))
+
+static const char base32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+/**
+ * State of a xorshift64* generator
+ */
+struct rng {
+    uint64_t s;
+};
+
+/**
+ * A state the generator writes records for.
+ */
+struct gen_state {
+    const char *code;
+    char prefix[2]; //First two geohash characters of every record of the state
+    double mean_kelvin; //Yearly mean temperature
+    double swing_kelvin; //Half the difference between the summer and winter means
+};
+
+/**
+ * @param r - Generator to advance
+ * @return The next 64 random bits
+ */
+static uint64_t next_u64(struct rng *r) {
+    r->s ^= r->s >> 12;
+    r->s ^= r->s << 25;
+    r->s ^= r->s >> 27;
+    return r->s * 2685821657736338717ULL;
+}
+
+/**
+ * @param r - Generator to advance
+ * @return A uniform double in [0, 1)
+ */
+static double next_unit(struct rng *r) {
+    return (double) (next_u64(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @param r - Generator to advance
+ * @param n - Number of values, more than 0
+ * @return A uniform integer in [0, n)
+ */
+static uint64_t next_below(struct rng *r, uint64_t n) {
+    return next_u64(r) % n;
+}
+
+/**
+ * Appends the decimal digits of v.
+ * @param p - Where to write
+ * @param v - Value to write
+ * @return The end of what was written
+ */
+static char *put_uint(char *p, unsigned long long v) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    while (n > 0) *p++ = digits[--n];
+    return p;
+}
+
+/**
+ * Appends v with a fixed number of decimals, the way the NOAA exports print them.
+ * @param p - Where to write
+ * @param v - Value to write, at least 0
+ * @param decimals - Digits after the point, at most 9
+ * @return The end of what was written
+ */
+static char *put_fixed(char *p, double v, int decimals) {
+    unsigned long long scale = 1;
+    for (int i = 0; i < decimals; i++) scale *= 10;
+    const unsigned long long scaled = (unsigned long long) (v * (double) scale + 0.5);
+    p = put_uint(p, scaled / scale);
+    *p++ = '.';
+    unsigned long long frac = scaled % scale;
+    for (unsigned long long d = scale / 10; d > 0; d /= 10) {
+        *p++ = (char) ('0' + frac / d);
+        frac %= d;
+    }
+    return p;
+}
+
+/**
+ * Writes one well formed record.
+ * @param p - Where to write, with room for MAX_LINE bytes
+ * @param st - State the record belongs to
+ * @param r - Generator to draw the fields from
+ * @return The end of the record, after its newline
+ */
+static char *put_record(char *p, const struct gen_state *st, struct rng *r) {
+    const long long ts = FIRST_TS + (long long) next_below(r, TS_RANGE / 3600000) * 3600000;
+    //Coldest in mid January and warmest in mid July, with a daily swing peaking in the afternoon
+    const double year = (double) ((ts - FIRST_TS) % (365LL * 24 * 3600000)) / (365.0 * 24 * 3600000);
+    const double day = (double) (ts % (24LL * 3600000)) / (24.0 * 3600000);
+    const double season = 1.0 - 2.0 * (year < 0.54 ? (0.54 - year) / 0.54 : (year - 0.54) / 0.46);
+    const double daily = 1.0 - 2.0 * (day < 0.6 ? (0.6 - day) / 0.6 : (day - 0.6) / 0.4);
+    const double kelvin = st->mean_kelvin + st->swing_kelvin * season + 4.0 * daily + 12.0 * (next_unit(r) - 0.5);
+    const double cloud = next_unit(r) < 0.3 ? 100.0 : next_unit(r) < 0.3 ? 0.0 : (double) next_below(r, 101);
+    const int snow = kelvin < 272.0 && next_unit(r) < 0.4;
+    const int lightning = kelvin > 290.0 && cloud > 60.0 && next_unit(r) < 0.05;
+
+    memcpy(p, st->code, 2);
+    p += 2;
+    *p++ = '\t';
+    p = put_uint(p, (unsigned long long) ts);
+    *p++ = '\t';
+    memcpy(p, st->prefix, 2);
+    for (int i = 2; i < GEOHASH_LEN; i++) p[i] = base32[next_below(r, 32)];
+    p += GEOHASH_LEN;
+    *p++ = '\t';
+    p = put_fixed(p, (double) next_below(r, 101), 1);
+    *p++ = '\t';
+    p = put_fixed(p, snow, 1);
+    *p++ = '\t';
+    p = put_fixed(p, cloud, 1);
+    *p++ = '\t';
+    p = put_fixed(p, lightning, 1);
+    *p++ = '\t';
+    p = put_fixed(p, (double) (97000 + next_below(r, 7000)), 1);
+    *p++ = '\t';
+    p = put_fixed(p, kelvin, 5);
+    *p++ = '\n';
+    return p;
+}
+
+/**
+ * Writes one malformed line, or an empty one.
+ * @param p - Where to write, with room for MAX_LINE bytes
+ * @param st - State the line claims to belong to
+ * @param r - Generator to draw the fields from
+ * @return The end of the line, after its newline
+ */
+static char *put_malformed(char *p, const struct gen_state *st, struct rng *r) {
+    char line[MAX_LINE];
+    const char *end = put_record(line, st, r);
+    const size_t len = (size_t) (end - line);
+    switch (next_below(r, 4)) {
+        case 0: { //Cut short after one of the first eight fields
+            size_t cut = 0;
+            for (int tabs = (int) next_below(r, 8) + 1; cut < len && tabs > 0; cut++) tabs -= line[cut] == '\t';
+            memcpy(p, line, cut - 1);
+            p += cut - 1;
+            break;
+        }
+        case 1: { //The humidity is not a number
+            const char *humidity = line + 2 + 1 + 13 + 1 + GEOHASH_LEN + 1;
+            memcpy(p, line, (size_t) (humidity - line));
+            p += humidity - line;
+            memcpy(p, "N/A", 3);
+            p += 3;
+            const char *rest = strchr(humidity, '\t');
+            memcpy(p, rest, (size_t) (end - rest) - 1);
+            p += end - rest - 1;
+            break;
+        }
+        case 2: //An extra field after the temperature
+            memcpy(p, line, len - 1);
+            p += len - 1;
+            memcpy(p, "\t0.0", 4);
+            p += 4;
+            break;
+        default: //Nothing at all
+            break;
+    }
+    *p++ = '\n';
+    return p;
+}
+
+/**
+ * @param arg - Size with an optional K, M, G or T suffix, in powers of 1024
+ * @param out - Receives the size in bytes
+ * @return 1 if arg is a valid size, 0 otherwise
+ */
+static int parse_size(const char *arg, unsigned long long *out) {
+    char *end;
+    errno = 0;
+    const unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || errno != 0) return 0;
+    int shift = 0;
+    switch (*end) {
+        case 'T': shift += 10; //Fall through
+        case 'G': shift += 10; //Fall through
+        case 'M': shift += 10; //Fall through
+        case 'K': shift += 10; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || (shift > 0 && n > (~0ULL >> shift))) return 0;
+    *out = n << shift;
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long size = 1ULL << 30;
+    double skew = 1.0;
+    double malformed = 0.0;
+    unsigned long long seed = 1;
+    const char *out_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        char *end = NULL;
+        if (strncmp(arg, "--size=", 7) == 0) {
+            if (!parse_size(arg + 7, &size)) {
+                fprintf(stderr, "Size must be a byte count with an optional K, M, G or T suffix\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(arg, "--skew=", 7) == 0) {
+            skew = strtod(arg + 7, &end);
+            if (end == arg + 7 || *end != '\0' || !(skew >= 0.0 && skew <= 10.0)) {
+                fprintf(stderr, "Skew must be between 0 and 10\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(arg, "--malformed=", 12) == 0) {
+            malformed = strtod(arg + 12, &end);
+            if (end == arg + 12 || *end != '\0' || !(malformed >= 0.0 && malformed <= 1.0)) {
+                fprintf(stderr, "Malformed rate must be between 0 and 1\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            seed = strtoull(arg + 7, &end, 10);
+            if (end == arg + 7 || *end != '\0') {
+                fprintf(stderr, "Seed must be a number\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--size=N[K|M|G|T]] [--skew=S] [--malformed=RATE] [--seed=N] [-o file]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    FILE *out = out_path != NULL ? fopen(out_path, "wb") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", out_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    //Zero would stick the generator at zero forever
+    struct rng r = {seed * 0x9E3779B97F4A7C15ULL + 0x2545F4914F6CDD1DULL};
+    if (r.s == 0) r.s = 1;
+
+    //Deal the states out in a seeded order, so the most common state depends on the seed, and give each one
+    //a climate and a geohash prefix of its own
+    struct gen_state states[NUM_CODES];
+    double cdf[NUM_CODES];
+    double total = 0;
+    for (int i = 0; i < NUM_CODES; i++) {
+        states[i].code = codes[i];
+        states[i].prefix[0] = base32[8 + next_below(&r, 24)];
+        states[i].prefix[1] = base32[next_below(&r, 32)];
+        states[i].mean_kelvin = 285.0 + 20.0 * (next_unit(&r) - 0.5);
+        states[i].swing_kelvin = 8.0 + 10.0 * next_unit(&r);
+    }
+    for (int i = NUM_CODES - 1; i > 0; i--) {
+        const int j = (int) next_below(&r, (uint64_t) i + 1);
+        const struct gen_state t = states[i];
+        states[i] = states[j];
+        states[j] = t;
+    }
+    //Rank k is drawn with a weight of 1 / k^skew
+    for (int i = 0; i < NUM_CODES; i++) {
+        total += 1.0 / pow(i + 1, skew);
+        cdf[i] = total;
+    }
+
+    char *buf = malloc(OUT_BUFFER_SZ + MAX_LINE);
+    if (buf == NULL) {
+        fprintf(stderr, "Error allocating the output buffer\n");
+        return EXIT_FAILURE;
+    }
+    unsigned long long written = 0;
+    while (written < size) {
+        char *p = buf;
+        while (p - buf < OUT_BUFFER_SZ && written + (unsigned long long) (p - buf) < size) {
+            const double u = next_unit(&r) * total;
+            int lo = 0, hi = NUM_CODES - 1;
+            while (lo < hi) {
+                const int mid = (lo + hi) / 2;
+                if (cdf[mid] > u) hi = mid;
+                else lo = mid + 1;
+            }
+            p = malformed > 0.0 && next_unit(&r) < malformed ? put_malformed(p, &states[lo], &r)
+                                                             : put_record(p, &states[lo], &r);
+        }
+        const size_t len = (size_t) (p - buf);
+        if (fwrite(buf, 1, len, out) != len) {
+            fprintf(stderr, "Error writing %s: %s\n", out_path != NULL ? out_path : "stdout", strerror(errno));
+            free(buf);
+            if (out != stdout) fclose(out);
+            return EXIT_FAILURE;
+        }
+        written += len;
+    }
+    free(buf);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error writing %s: %s\n", out_path != NULL ? out_path : "stdout", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
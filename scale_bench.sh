@@ -0,0 +1,68 @@
+#!/bin/sh
+# Scaling benchmark, run with 'make scale-bench'.
+#
+# Generates synthetic TDV files with gen-tdv and runs climate-fast --bench on each of them for every thread
+# count. The best iteration of every run is appended to $RESULTS as a tab separated row, and compared to the
+# previous row for the same input and thread count. The script exits with status 1 when any run got slower
+# than that by more than $TOLERANCE percent.
+#
+# Settings, from the environment:
+#   SIZES       Sizes of the files to generate, with K, M, G or T suffixes (default 1G)
+#   THREADS     Thread counts to pass to -j (default 1 2 4 8)
+#   ITERATIONS  Benchmark iterations per run, the best one is recorded (default 3)
+#   SKEW        Zipf exponent of the state distribution (default 1.0)
+#   MALFORMED   Fraction of malformed lines (default 0.001)
+#   DATA_DIR    Where the generated files are kept between runs (default bench-data)
+#   RESULTS     File the results are appended to (default bench-results.tsv)
+#   TOLERANCE   Percent slowdown reported as a regression (default 10)
+
+SIZES=${SIZES:-1G}
+THREADS=${THREADS:-1 2 4 8}
+ITERATIONS=${ITERATIONS:-3}
+SKEW=${SKEW:-1.0}
+MALFORMED=${MALFORMED:-0.001}
+DATA_DIR=${DATA_DIR:-bench-data}
+RESULTS=${RESULTS:-bench-results.tsv}
+TOLERANCE=${TOLERANCE:-10}
+
+mkdir -p "$DATA_DIR" || exit 1
+if [ ! -s "$RESULTS" ]; then
+    printf 'date\tcommit\tsize\tskew\tmalformed\tthreads\tbest_ms\trecords_per_sec\tmb_per_sec\n' > "$RESULTS"
+fi
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+status=0
+
+for size in $SIZES; do
+    #The file name holds every generator setting, so a file is only reused for the same input
+    file="$DATA_DIR/synthetic-$size-skew$SKEW-malformed$MALFORMED.tdv"
+    if [ ! -s "$file" ]; then
+        echo "Generating $file"
+        ./gen-tdv --size="$size" --skew="$SKEW" --malformed="$MALFORMED" -o "$file.tmp" && mv "$file.tmp" "$file" \
+            || { rm -f "$file.tmp"; exit 1; }
+    fi
+    for threads in $THREADS; do
+        best=$(./climate-fast --bench="$ITERATIONS" -j "$threads" "$file" | grep '^Best iteration:')
+        if [ -z "$best" ]; then
+            echo "climate-fast --bench failed on $file with $threads thread(s)"
+            exit 1
+        fi
+        #Best iteration: 123.456 ms, 7890 records/sec, 12.3 MB/sec
+        row=$(echo "$best" | awk -v date="$(date -u +%Y-%m-%dT%H:%M:%SZ)" -v commit="$commit" -v size="$size" \
+            -v skew="$SKEW" -v malformed="$MALFORMED" -v threads="$threads" \
+            '{ printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n", date, commit, size, skew, malformed, threads, \
+               $3, $5, $7 }')
+        #The last earlier run of the same input and thread count
+        previous=$(awk -F '\t' -v size="$size" -v skew="$SKEW" -v malformed="$MALFORMED" -v threads="$threads" \
+            'NR > 1 && $3 == size && $4 == skew && $5 == malformed && $6 == threads { mb = $9 } END { print mb }' \
+            "$RESULTS")
+        printf '%s\n' "$row" >> "$RESULTS"
+        mb=$(printf '%s\n' "$row" | cut -f 9)
+        echo "$size, $threads thread(s): $mb MB/sec${previous:+ (previous $previous MB/sec)}"
+        if [ -n "$previous" ] && awk -v mb="$mb" -v prev="$previous" -v tol="$TOLERANCE" \
+            'BEGIN { exit !(mb < prev * (100 - tol) / 100) }'; then
+            echo "Regression: $size with $threads thread(s) is more than $TOLERANCE% slower than the previous run"
+            status=1
+        fi
+    done
+done
+exit $status